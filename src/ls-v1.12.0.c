@@ -0,0 +1,1521 @@
+/*
+ ============================================================================
+ Name        : ls-v1.12.0.c
+ Description : Feature 13 – In-Pass Subtree Size Totals (--total-size)
+               Includes all previous features (1–12)
+ ============================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <fnmatch.h>
+
+#define COL_PADDING 2
+#define DEFAULT_TERM_WIDTH 80
+#define INITIAL_FILES 256
+
+// ---------- ANSI color codes ----------
+#define RESET_COLOR   "\033[0m"
+#define BLUE_COLOR    "\033[0;34m"
+#define GREEN_COLOR   "\033[0;32m"
+#define RED_COLOR     "\033[0;31m"
+#define MAGENTA_COLOR "\033[0;35m"
+#define REVERSE_VIDEO "\033[7m"
+
+// All listing output goes through 'out'. It is stdout except while
+// --total-size holds a subtree's output back in a memory stream.
+static FILE *out;
+
+// ---------- Get terminal width ----------
+int get_terminal_width() {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0)
+        return DEFAULT_TERM_WIDTH;
+    return (int)w.ws_col;
+}
+
+// ---------- Directory entries ----------
+// One record per listed name. The lstat() data is fetched lazily through
+// entry_stat(), or filled in up front when it comes from --cache.
+struct file_entry {
+    char *name;
+    unsigned char d_type;   // DT_* from readdir, DT_UNKNOWN if not known
+    int has_stat;           // 'st' is valid
+    struct stat st;
+};
+
+// Returns the lstat() data for 'e', fetching it on first use.
+const struct stat *entry_stat(const char *path, struct file_entry *e) {
+    if (!e->has_stat) {
+        char full[1024];
+        snprintf(full, sizeof(full), "%s/%s", path, e->name);
+        if (lstat(full, &e->st) == -1) return NULL;
+        e->has_stat = 1;
+    }
+    return &e->st;
+}
+
+// ---------- Case-insensitive alphabetical sort ----------
+int cmp_names(const void *a, const void *b) {
+    const struct file_entry *A = a;
+    const struct file_entry *B = b;
+    int r = strcasecmp(A->name, B->name);
+    // Tie-break on the exact bytes so the order is total and entries can
+    // be found again by binary search (see --watch).
+    return r ? r : strcmp(A->name, B->name);
+}
+
+// ---------- Color logic ----------
+const char* get_color(const char *path, struct file_entry *e) {
+    const struct stat *st = entry_stat(path, e);
+    const char *name = e->name;
+    if (!st)
+        return RESET_COLOR;
+
+    if (S_ISDIR(st->st_mode))
+        return BLUE_COLOR;
+    else if (S_ISLNK(st->st_mode))
+        return MAGENTA_COLOR;
+    else if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode) || S_ISSOCK(st->st_mode))
+        return REVERSE_VIDEO;
+    else if (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
+        return GREEN_COLOR;
+    else if (strstr(name, ".tar") || strstr(name, ".gz") ||
+             strstr(name, ".zip") || strstr(name, ".tgz"))
+        return RED_COLOR;
+    else
+        return RESET_COLOR;
+}
+
+// ---------- Ignore patterns (--ignore / -I) ----------
+// Each pattern is classified once when it is added, so the common shapes
+// (".git", "node_modules", "build*", "*.tmp") are matched with a length
+// check and memcmp instead of a full fnmatch() per entry.
+enum ignore_kind { IGN_LITERAL, IGN_PREFIX, IGN_SUFFIX, IGN_CONTAINS, IGN_ALL, IGN_GLOB };
+
+struct ignore_pattern {
+    enum ignore_kind kind;
+    const char *text;   // literal part (or full pattern for IGN_GLOB)
+    size_t len;         // length of the literal part
+};
+
+static struct ignore_pattern *ignore_list = NULL;
+static int ignore_count = 0;
+
+static int has_glob_chars(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+            return 1;
+    return 0;
+}
+
+// Classifies 'pattern' into one of the matcher kinds above. The pattern
+// text is referenced, not copied, so it must outlive the compiled form.
+void compile_pattern(struct ignore_pattern *p, const char *pattern, size_t len) {
+    int lead  = (len > 0 && pattern[0] == '*');
+    int trail = (len > 1 && pattern[len - 1] == '*');
+    const char *body = pattern + lead;
+    size_t body_len = len - lead - trail;
+
+    if (len == 1 && lead) {
+        p->kind = IGN_ALL; p->text = pattern; p->len = 0;
+    } else if (has_glob_chars(body, body_len)) {
+        p->kind = IGN_GLOB; p->text = pattern; p->len = len;
+    } else if (lead && trail) {
+        p->kind = IGN_CONTAINS; p->text = body; p->len = body_len;
+    } else if (lead) {
+        p->kind = IGN_SUFFIX; p->text = body; p->len = body_len;
+    } else if (trail) {
+        p->kind = IGN_PREFIX; p->text = body; p->len = body_len;
+    } else {
+        p->kind = IGN_LITERAL; p->text = pattern; p->len = len;
+    }
+}
+
+int match_pattern(const struct ignore_pattern *p, const char *name, size_t len) {
+    switch (p->kind) {
+        case IGN_LITERAL:
+            return len == p->len && memcmp(name, p->text, len) == 0;
+        case IGN_PREFIX:
+            return len >= p->len && memcmp(name, p->text, p->len) == 0;
+        case IGN_SUFFIX:
+            return len >= p->len &&
+                   memcmp(name + len - p->len, p->text, p->len) == 0;
+        case IGN_CONTAINS:
+            return len >= p->len && memmem(name, len, p->text, p->len) != NULL;
+        case IGN_ALL:
+            return 1;
+        case IGN_GLOB:
+            return fnmatch(p->text, name, 0) == 0;
+    }
+    return 0;
+}
+
+void add_ignore_pattern(const char *pattern) {
+    struct ignore_pattern *grown =
+        realloc(ignore_list, sizeof(*ignore_list) * (ignore_count + 1));
+    if (!grown) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    ignore_list = grown;
+    compile_pattern(&ignore_list[ignore_count++], pattern, strlen(pattern));
+}
+
+// Returns 1 if 'name' (of length 'len') matches any --ignore pattern.
+int is_ignored(const char *name, size_t len) {
+    for (int i = 0; i < ignore_count; i++)
+        if (match_pattern(&ignore_list[i], name, len)) return 1;
+    return 0;
+}
+
+// ---------- .gitignore rule stack (--gitignore) ----------
+// Every directory visited with --gitignore has its .gitignore parsed once
+// and pushed as a frame; the frame is popped when do_ls() leaves the
+// directory. Rules are checked innermost frame first and, within a frame,
+// last rule first, so the first hit is the one git would apply.
+struct gi_rule {
+    struct ignore_pattern pat;
+    int negate;     // "!pattern" re-includes
+    int dir_only;   // "pattern/" only matches directories
+    int anchored;   // contains a '/', matched against the path below the frame
+};
+
+struct gi_frame {
+    size_t base_len;        // strlen() of the directory owning the file
+    char *buf;              // file contents; rule texts point into it
+    struct gi_rule *rules;
+    int n;
+};
+
+#define GI_MAX_DEPTH 256
+
+static int flag_gitignore = 0;
+static int flag_stats = 0;
+static struct gi_frame gi_stack[GI_MAX_DEPTH];
+static int gi_depth = 0;
+static int gi_rules_active = 0;
+
+// Counters reported by --stats.
+static long stat_gi_files = 0, stat_gi_rules = 0;
+static long stat_gi_checked = 0, stat_gi_ignored = 0;
+static double stat_gi_seconds = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Splits 'buf' in place into rules. Returns the number of rules parsed.
+static int parse_gitignore(char *buf, struct gi_rule **out) {
+    int cap = 16, n = 0;
+    struct gi_rule *rules = malloc(sizeof(*rules) * cap);
+    if (!rules) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = buf;
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\r') line[--len] = '\0';
+        while (len && (line[len - 1] == ' ' || line[len - 1] == '\t') &&
+               !(len > 1 && line[len - 2] == '\\'))
+            line[--len] = '\0';
+
+        if (len == 0 || line[0] == '#') { line = next; continue; }
+
+        struct gi_rule r = {0};
+        char *pat = line;
+        if (pat[0] == '!') { r.negate = 1; pat++; len--; }
+        else if (pat[0] == '\\' && (pat[1] == '!' || pat[1] == '#')) { pat++; len--; }
+        if (len && pat[len - 1] == '/') { r.dir_only = 1; pat[--len] = '\0'; }
+        if (len >= 3 && strncmp(pat, "**/", 3) == 0) { pat += 3; len -= 3; }
+        else if (len && pat[0] == '/') { r.anchored = 1; pat++; len--; }
+        if (memchr(pat, '/', len)) r.anchored = 1;
+        if (len == 0) { line = next; continue; }
+
+        if (r.anchored) {
+            // Path patterns go straight to fnmatch(FNM_PATHNAME).
+            r.pat.kind = IGN_GLOB; r.pat.text = pat; r.pat.len = len;
+        } else {
+            compile_pattern(&r.pat, pat, len);
+        }
+
+        if (n == cap) {
+            cap *= 2;
+            struct gi_rule *grown = realloc(rules, sizeof(*rules) * cap);
+            if (!grown) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            rules = grown;
+        }
+        rules[n++] = r;
+        line = next;
+    }
+    *out = rules;
+    return n;
+}
+
+// Pushes a frame for 'path'. Always pushes (possibly empty) so that the
+// caller can pop unconditionally.
+void gitignore_push(const char *path) {
+    if (gi_depth == GI_MAX_DEPTH) {
+        fprintf(stderr, "%s: .gitignore nesting too deep\n", path);
+        exit(EXIT_FAILURE);
+    }
+    struct gi_frame *f = &gi_stack[gi_depth++];
+    f->base_len = strlen(path);
+    f->buf = NULL;
+    f->rules = NULL;
+    f->n = 0;
+
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/.gitignore", path);
+    FILE *fp = fopen(file, "r");
+    if (!fp) return;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && st.st_size > 0) {
+        f->buf = malloc((size_t)st.st_size + 1);
+        if (f->buf) {
+            size_t got = fread(f->buf, 1, (size_t)st.st_size, fp);
+            f->buf[got] = '\0';
+            f->n = parse_gitignore(f->buf, &f->rules);
+            gi_rules_active += f->n;
+            stat_gi_files++;
+            stat_gi_rules += f->n;
+        }
+    }
+    fclose(fp);
+}
+
+void gitignore_pop(void) {
+    struct gi_frame *f = &gi_stack[--gi_depth];
+    gi_rules_active -= f->n;
+    free(f->rules);
+    free(f->buf);
+}
+
+// Decides whether entry 'name' inside directory 'path' is ignored by the
+// rules currently on the stack. 'is_dir' is -1 if not yet known; it is
+// only resolved (via lstat) when a directory-only rule needs it.
+int gitignore_match(const char *path, const char *name, size_t len, int is_dir) {
+    char rel[1024];
+    size_t path_len = strlen(path);
+
+    for (int d = gi_depth - 1; d >= 0; d--) {
+        const struct gi_frame *f = &gi_stack[d];
+        for (int i = f->n - 1; i >= 0; i--) {
+            const struct gi_rule *r = &f->rules[i];
+            int hit;
+            if (r->anchored) {
+                // Path of the entry relative to the directory of this frame.
+                const char *below = path + f->base_len;
+                if (*below == '/') below++;
+                snprintf(rel, sizeof(rel), "%s%s%s",
+                                   below, *below ? "/" : "", name);
+                hit = fnmatch(r->pat.text, rel, FNM_PATHNAME) == 0;
+            } else {
+                hit = match_pattern(&r->pat, name, len);
+            }
+            if (!hit) continue;
+            if (r->dir_only) {
+                if (is_dir < 0) {
+                    char full[1024];
+                    struct stat st;
+                    snprintf(full, sizeof(full), "%.*s/%s", (int)path_len, path, name);
+                    is_dir = lstat(full, &st) == 0 && S_ISDIR(st.st_mode);
+                }
+                if (!is_dir) continue;
+            }
+            return !r->negate;
+        }
+    }
+    return 0;
+}
+
+// Applies --ignore and --gitignore to one name. Returns 1 to drop it.
+int entry_filtered(const char *path, const char *name, unsigned char d_type) {
+    size_t len = strlen(name);
+    if (ignore_count && is_ignored(name, len))
+        return 1;
+    if (gi_rules_active) {
+        int is_dir = d_type == DT_UNKNOWN ? -1 : d_type == DT_DIR;
+        double t0 = flag_stats ? now_seconds() : 0;
+        int ignored = gitignore_match(path, name, len, is_dir);
+        if (flag_stats) stat_gi_seconds += now_seconds() - t0;
+        stat_gi_checked++;
+        if (ignored) { stat_gi_ignored++; return 1; }
+    }
+    return 0;
+}
+
+// ---------- Persistent directory cache (--cache=FILE) ----------
+// Each directory's raw listing (every non-hidden name, before --ignore and
+// --gitignore are applied) is recorded together with the lstat() data of
+// its entries, keyed by the directory's (st_dev, st_ino). On a later run a
+// directory whose mtime and ctime still match is served from the record
+// with no readdir and no per-entry lstat. Only the directory itself is
+// stat'ed, so changes to a file's own metadata that leave the directory
+// untouched are not noticed until the directory changes.
+//
+// File layout, host byte order:
+//   struct cache_file_header
+//   ndirs x { struct cache_dir_header,
+//             count x { struct cache_disk_entry, name bytes, '\0' } }
+// A file with a different magic, version or record size is ignored and
+// rewritten from scratch.
+#define CACHE_MAGIC   0x5849534cu   /* "LSIX" */
+#define CACHE_VERSION 1
+
+struct cache_file_header {
+    uint32_t magic, version, entry_size, ndirs;
+};
+
+struct cache_dir_header {
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint32_t count, pad;
+};
+
+struct cache_disk_entry {
+    uint64_t dev, ino, nlink, rdev, size, blocks;
+    int64_t atime_sec, atime_nsec, mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint32_t mode, uid, gid, blksize;
+    uint32_t name_len;
+    uint8_t d_type, has_stat, pad[2];
+};
+
+struct cache_dir {
+    struct cache_dir_header hdr;
+    struct cache_disk_entry *ents;
+    char **names;           // point into cache_file_buf unless 'owned'
+    int owned;
+};
+
+static const char *cache_path = NULL;
+static char *cache_file_buf = NULL;
+static struct cache_dir *cache_table = NULL;   // open addressing
+static size_t cache_cap = 0, cache_used = 0;
+static int cache_dirty = 0;
+static long stat_cache_hits = 0, stat_cache_misses = 0;
+
+static size_t cache_slot(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino * 0x9E3779B97F4A7C15ull) ^ (dev * 0xC2B2AE3D27D4EB4Full);
+    return (size_t)(h ^ (h >> 29)) & (cache_cap - 1);
+}
+
+static struct cache_dir *cache_find_slot(uint64_t dev, uint64_t ino) {
+    size_t i = cache_slot(dev, ino);
+    while (cache_table[i].ents &&
+           !(cache_table[i].hdr.dev == dev && cache_table[i].hdr.ino == ino))
+        i = (i + 1) & (cache_cap - 1);
+    return &cache_table[i];
+}
+
+static void cache_grow(void) {
+    size_t old_cap = cache_cap;
+    struct cache_dir *old = cache_table;
+    cache_cap = old_cap ? old_cap * 2 : 64;
+    cache_table = calloc(cache_cap, sizeof(*cache_table));
+    if (!cache_table) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].ents)
+            *cache_find_slot(old[i].hdr.dev, old[i].hdr.ino) = old[i];
+    free(old);
+}
+
+static void cache_free_dir(struct cache_dir *cd) {
+    if (cd->owned)
+        for (uint32_t i = 0; i < cd->hdr.count; i++) free(cd->names[i]);
+    free(cd->names);
+    free(cd->ents);
+}
+
+// Inserts 'cd', replacing any record for the same directory.
+static void cache_insert(const struct cache_dir *cd) {
+    if ((cache_used + 1) * 2 > cache_cap) cache_grow();
+    struct cache_dir *slot = cache_find_slot(cd->hdr.dev, cd->hdr.ino);
+    if (slot->ents) cache_free_dir(slot);
+    else cache_used++;
+    *slot = *cd;
+}
+
+static void stat_to_disk(const struct stat *st, struct cache_disk_entry *d) {
+    d->dev = st->st_dev;     d->ino = st->st_ino;
+    d->nlink = st->st_nlink; d->rdev = st->st_rdev;
+    d->size = st->st_size;   d->blocks = st->st_blocks;
+    d->atime_sec = st->st_atim.tv_sec; d->atime_nsec = st->st_atim.tv_nsec;
+    d->mtime_sec = st->st_mtim.tv_sec; d->mtime_nsec = st->st_mtim.tv_nsec;
+    d->ctime_sec = st->st_ctim.tv_sec; d->ctime_nsec = st->st_ctim.tv_nsec;
+    d->mode = st->st_mode;   d->uid = st->st_uid;
+    d->gid = st->st_gid;     d->blksize = st->st_blksize;
+}
+
+static void disk_to_stat(const struct cache_disk_entry *d, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = d->dev;     st->st_ino = d->ino;
+    st->st_nlink = d->nlink; st->st_rdev = d->rdev;
+    st->st_size = d->size;   st->st_blocks = d->blocks;
+    st->st_atim.tv_sec = d->atime_sec; st->st_atim.tv_nsec = d->atime_nsec;
+    st->st_mtim.tv_sec = d->mtime_sec; st->st_mtim.tv_nsec = d->mtime_nsec;
+    st->st_ctim.tv_sec = d->ctime_sec; st->st_ctim.tv_nsec = d->ctime_nsec;
+    st->st_mode = d->mode;   st->st_uid = d->uid;
+    st->st_gid = d->gid;     st->st_blksize = d->blksize;
+}
+
+// Loads the cache file into the table. A missing, truncated or foreign
+// file simply leaves the table empty.
+void cache_load(const char *file) {
+    cache_grow();
+    FILE *fp = fopen(file, "rb");
+    if (!fp) return;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1 || st.st_size < (off_t)sizeof(struct cache_file_header)) {
+        fclose(fp);
+        return;
+    }
+    cache_file_buf = malloc((size_t)st.st_size);
+    if (!cache_file_buf || fread(cache_file_buf, 1, (size_t)st.st_size, fp) != (size_t)st.st_size) {
+        fclose(fp);
+        free(cache_file_buf);
+        cache_file_buf = NULL;
+        return;
+    }
+    fclose(fp);
+
+    const char *p = cache_file_buf, *end = cache_file_buf + st.st_size;
+    struct cache_file_header fh;
+    memcpy(&fh, p, sizeof(fh));
+    p += sizeof(fh);
+    if (fh.magic != CACHE_MAGIC || fh.version != CACHE_VERSION ||
+        fh.entry_size != sizeof(struct cache_disk_entry))
+        return;
+
+    for (uint32_t d = 0; d < fh.ndirs; d++) {
+        struct cache_dir cd = {0};
+        if (end - p < (ptrdiff_t)sizeof(cd.hdr)) return;
+        memcpy(&cd.hdr, p, sizeof(cd.hdr));
+        p += sizeof(cd.hdr);
+
+        cd.ents = malloc(sizeof(*cd.ents) * (cd.hdr.count ? cd.hdr.count : 1));
+        cd.names = malloc(sizeof(*cd.names) * (cd.hdr.count ? cd.hdr.count : 1));
+        if (!cd.ents || !cd.names) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = 0; i < cd.hdr.count; i++) {
+            if (end - p < (ptrdiff_t)sizeof(cd.ents[i])) { cache_free_dir(&cd); return; }
+            memcpy(&cd.ents[i], p, sizeof(cd.ents[i]));
+            p += sizeof(cd.ents[i]);
+            if ((size_t)(end - p) < cd.ents[i].name_len + 1 ||
+                p[cd.ents[i].name_len] != '\0') {
+                cache_free_dir(&cd);
+                return;
+            }
+            cd.names[i] = (char *)p;
+            p += cd.ents[i].name_len + 1;
+        }
+        cache_insert(&cd);
+    }
+}
+
+// Writes the table back through a temporary file and rename(), so a
+// concurrent reader never sees a half-written cache.
+void cache_save(const char *file) {
+    if (!cache_dirty) return;
+
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", file, (long)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        perror(tmp);
+        return;
+    }
+
+    struct cache_file_header fh = {
+        CACHE_MAGIC, CACHE_VERSION, sizeof(struct cache_disk_entry), (uint32_t)cache_used
+    };
+    fwrite(&fh, sizeof(fh), 1, fp);
+    for (size_t s = 0; s < cache_cap; s++) {
+        const struct cache_dir *cd = &cache_table[s];
+        if (!cd->ents) continue;
+        fwrite(&cd->hdr, sizeof(cd->hdr), 1, fp);
+        for (uint32_t i = 0; i < cd->hdr.count; i++) {
+            fwrite(&cd->ents[i], sizeof(cd->ents[i]), 1, fp);
+            fwrite(cd->names[i], 1, cd->ents[i].name_len + 1, fp);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, file) == -1) {
+        perror(file);
+        unlink(tmp);
+    }
+}
+
+// ---------- Daemon cache invalidation ----------
+// Under --daemon the cache table lives only in memory and every recorded
+// directory carries an inotify watch. Any event on the directory or one
+// of its entries marks the record stale, so entry metadata stays exact
+// and no racy-timestamp guard is needed. 'daemon_wd_key' maps a watch
+// descriptor back to the directory's (dev, ino).
+static int daemon_mode = 0;
+static int daemon_inotify_fd = -1;
+static struct { uint64_t dev, ino; } *daemon_wd_key = NULL;
+static int daemon_wd_cap = 0;
+
+#define DAEMON_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Watches 'path' before it is read. Returns 0 if the listing must not be
+// recorded because no watch could be placed (e.g. the inotify limit).
+static int daemon_watch_dir(const char *path, const struct stat *dirst) {
+    int wd = inotify_add_watch(daemon_inotify_fd, path, DAEMON_WATCH_MASK);
+    if (wd < 0) return 0;
+    if (wd >= daemon_wd_cap) {
+        int cap = daemon_wd_cap ? daemon_wd_cap : 64;
+        while (cap <= wd) cap *= 2;
+        void *grown = realloc(daemon_wd_key, sizeof(*daemon_wd_key) * cap);
+        if (!grown) return 0;
+        daemon_wd_key = grown;
+        daemon_wd_cap = cap;
+    }
+    daemon_wd_key[wd].dev = dirst->st_dev;
+    daemon_wd_key[wd].ino = dirst->st_ino;
+    return 1;
+}
+
+// Applies all pending inotify events to the cache table.
+static void daemon_invalidate(void) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(daemon_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Lost events: nothing recorded can be trusted.
+                for (size_t i = 0; i < cache_cap; i++)
+                    if (cache_table[i].ents) cache_table[i].hdr.mtime_sec = -1;
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= daemon_wd_cap) continue;
+            struct cache_dir *cd = cache_find_slot(daemon_wd_key[ev->wd].dev,
+                                                   daemon_wd_key[ev->wd].ino);
+            if (cd->ents) cd->hdr.mtime_sec = -1;   // fails every lookup
+        }
+    }
+}
+
+// Returns the record for directory 'dirst' if it is still valid.
+static struct cache_dir *cache_lookup(const struct stat *dirst) {
+    struct cache_dir *cd = cache_find_slot(dirst->st_dev, dirst->st_ino);
+    if (!cd->ents ||
+        cd->hdr.mtime_sec != dirst->st_mtim.tv_sec ||
+        cd->hdr.mtime_nsec != dirst->st_mtim.tv_nsec ||
+        cd->hdr.ctime_sec != dirst->st_ctim.tv_sec ||
+        cd->hdr.ctime_nsec != dirst->st_ctim.tv_nsec)
+        return NULL;
+    return cd;
+}
+
+// ---------- Read filenames ----------
+static void grow_entries(struct file_entry **ents, int *cap) {
+    *cap *= 2;
+    struct file_entry *grown = realloc(*ents, sizeof(**ents) * *cap);
+    if (!grown) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    *ents = grown;
+}
+
+// Builds the entry list for 'path' from a validated cache record.
+static int entries_from_cache(const char *path, const struct cache_dir *cd,
+                              struct file_entry **out) {
+    int cap = cd->hdr.count ? (int)cd->hdr.count : 1, count = 0;
+    struct file_entry *ents = malloc(sizeof(*ents) * cap);
+    if (!ents) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < cd->hdr.count; i++) {
+        const struct cache_disk_entry *d = &cd->ents[i];
+        if (entry_filtered(path, cd->names[i], d->d_type)) continue;
+        struct file_entry *e = &ents[count++];
+        e->name = strdup(cd->names[i]);
+        e->d_type = d->d_type;
+        e->has_stat = d->has_stat;
+        if (d->has_stat) disk_to_stat(d, &e->st);
+    }
+    qsort(ents, count, sizeof(*ents), cmp_names);
+    *out = ents;
+    return count;
+}
+
+int read_filenames(const char *path, struct file_entry **out) {
+    struct stat dirst;
+    int caching = (cache_path || daemon_mode) && stat(path, &dirst) == 0;
+    if (caching) {
+        struct cache_dir *cd = cache_lookup(&dirst);
+        if (cd) {
+            stat_cache_hits++;
+            return entries_from_cache(path, cd, out);
+        }
+        stat_cache_misses++;
+    }
+
+    int watched = caching && daemon_mode && daemon_watch_dir(path, &dirst);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        *out = NULL;
+        return 0;
+    }
+
+    int cap = INITIAL_FILES;
+    struct file_entry *ents = malloc(sizeof(*ents) * cap);
+    if (!ents) {
+        perror("malloc");
+        closedir(dir);
+        *out = NULL;
+        return 0;
+    }
+
+    // With --cache every name is kept for the record, filtered or not;
+    // 'raw_of' maps each listed entry back to its raw position.
+    struct cache_dir rec = {0};
+    int raw_cap = 0, *raw_of = NULL;
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        if (caching) {
+            if ((int)rec.hdr.count == raw_cap) {
+                raw_cap = raw_cap ? raw_cap * 2 : INITIAL_FILES;
+                rec.ents = realloc(rec.ents, sizeof(*rec.ents) * raw_cap);
+                rec.names = realloc(rec.names, sizeof(*rec.names) * raw_cap);
+                if (!rec.ents || !rec.names) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            struct cache_disk_entry *d = &rec.ents[rec.hdr.count];
+            memset(d, 0, sizeof(*d));
+            d->name_len = strlen(entry->d_name);
+            d->d_type = entry->d_type;
+            rec.names[rec.hdr.count++] = strdup(entry->d_name);
+        }
+        // Pruned here, straight off the readdir buffer: an ignored entry is
+        // never strdup'd or stat'ed, and an ignored directory never opened.
+        if (entry_filtered(path, entry->d_name, entry->d_type))
+            continue;
+        if (count == cap) grow_entries(&ents, &cap);
+        if (caching) {
+            raw_of = realloc(raw_of, sizeof(*raw_of) * cap);
+            if (!raw_of) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            raw_of[count] = rec.hdr.count - 1;
+        }
+        ents[count].name = strdup(entry->d_name);
+        ents[count].d_type = entry->d_type;
+        ents[count].has_stat = 0;
+        count++;
+    }
+    closedir(dir);
+
+    if (caching) {
+        // Populate the record so the next run needs no per-entry lstat.
+        for (int i = 0; i < count; i++) {
+            struct cache_disk_entry *d = &rec.ents[raw_of[i]];
+            if (entry_stat(path, &ents[i])) {
+                stat_to_disk(&ents[i].st, d);
+                d->has_stat = 1;
+            }
+        }
+        free(raw_of);
+
+        // A directory modified within the last second could change again
+        // without its timestamp moving; leave it out rather than risk a
+        // stale hit.
+        rec.hdr.dev = dirst.st_dev;
+        rec.hdr.ino = dirst.st_ino;
+        rec.hdr.mtime_sec = dirst.st_mtim.tv_sec;
+        rec.hdr.mtime_nsec = dirst.st_mtim.tv_nsec;
+        rec.hdr.ctime_sec = dirst.st_ctim.tv_sec;
+        rec.hdr.ctime_nsec = dirst.st_ctim.tv_nsec;
+        rec.owned = 1;
+        if (daemon_mode ? watched : dirst.st_mtime < time(NULL) - 1) {
+            if (!rec.ents) {
+                rec.ents = malloc(sizeof(*rec.ents));
+                rec.names = malloc(sizeof(*rec.names));
+            }
+            cache_insert(&rec);
+            cache_dirty = 1;
+        } else {
+            cache_free_dir(&rec);
+        }
+    }
+
+    qsort(ents, count, sizeof(*ents), cmp_names);
+    *out = ents;
+    return count;
+}
+
+void free_names(struct file_entry *ents, int n) {
+    for (int i = 0; i < n; i++) free(ents[i].name);
+    free(ents);
+}
+
+// ---------- uid/gid name cache ----------
+// Direct-mapped by id. A directory rarely has more than a handful of
+// owners, so almost every lookup after the first is a hit, and under
+// --daemon the table stays warm across requests.
+#define ID_CACHE_SIZE 256
+
+struct id_name {
+    int used;
+    unsigned id;
+    char *name;     // NULL if the id has no name ("?")
+};
+
+static struct id_name uid_cache[ID_CACHE_SIZE], gid_cache[ID_CACHE_SIZE];
+
+const char *uid_to_name(uid_t uid) {
+    struct id_name *c = &uid_cache[uid & (ID_CACHE_SIZE - 1)];
+    if (!c->used || c->id != uid) {
+        struct passwd *pw = getpwuid(uid);
+        free(c->name);
+        c->name = pw ? strdup(pw->pw_name) : NULL;
+        c->id = uid;
+        c->used = 1;
+    }
+    return c->name ? c->name : "?";
+}
+
+const char *gid_to_name(gid_t gid) {
+    struct id_name *c = &gid_cache[gid & (ID_CACHE_SIZE - 1)];
+    if (!c->used || c->id != gid) {
+        struct group *gr = getgrgid(gid);
+        free(c->name);
+        c->name = gr ? strdup(gr->gr_name) : NULL;
+        c->id = gid;
+        c->used = 1;
+    }
+    return c->name ? c->name : "?";
+}
+
+// ---------- Long Listing (-l) ----------
+void print_long_listing(const char *path, struct file_entry *ents, int n) {
+    for (int i = 0; i < n; i++) {
+        const struct stat *sp = entry_stat(path, &ents[i]);
+        if (!sp) {
+            perror(ents[i].name);
+            continue;
+        }
+        struct stat st = *sp;
+
+        fprintf(out, (S_ISDIR(st.st_mode)) ? "d" : "-");
+        fprintf(out, (st.st_mode & S_IRUSR) ? "r" : "-");
+        fprintf(out, (st.st_mode & S_IWUSR) ? "w" : "-");
+        fprintf(out, (st.st_mode & S_IXUSR) ? "x" : "-");
+        fprintf(out, (st.st_mode & S_IRGRP) ? "r" : "-");
+        fprintf(out, (st.st_mode & S_IWGRP) ? "w" : "-");
+        fprintf(out, (st.st_mode & S_IXGRP) ? "x" : "-");
+        fprintf(out, (st.st_mode & S_IROTH) ? "r" : "-");
+        fprintf(out, (st.st_mode & S_IWOTH) ? "w" : "-");
+        fprintf(out, (st.st_mode & S_IXOTH) ? "x" : "-");
+
+        char timebuf[64];
+        strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", localtime(&st.st_mtime));
+
+        const char *color = get_color(path, &ents[i]);
+        fprintf(out, " %2ld %-8s %-8s %8ld %s %s%s%s\n",
+               (long)st.st_nlink,
+               uid_to_name(st.st_uid),
+               gid_to_name(st.st_gid),
+               (long)st.st_size,
+               timebuf,
+               color, ents[i].name, RESET_COLOR);
+    }
+}
+
+// ---------- Column Display (-C) ----------
+void print_down_then_across(const char *path, struct file_entry *ents, int n) {
+    if (n == 0) return;
+    int term_width = get_terminal_width();
+    size_t maxlen = 0;
+    for (int i = 0; i < n; i++)
+        if (strlen(ents[i].name) > maxlen) maxlen = strlen(ents[i].name);
+    int col_width = (int)maxlen + COL_PADDING;
+    if (col_width <= 0) col_width = 1;
+    int cols = term_width / col_width;
+    if (cols < 1) cols = 1;
+    if (cols > n) cols = n;
+    int rows = (n + cols - 1) / cols;
+    if (rows == 1 && n > 3) { rows = (n + 1) / 2; cols = (n + rows - 1) / rows; }
+
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            int idx = r + c * rows;
+            if (idx < n) {
+                const char *color = get_color(path, &ents[idx]);
+                fprintf(out, "%s%-*s%s", color, (int)maxlen, ents[idx].name, RESET_COLOR);
+            }
+            if (c < cols - 1)
+                for (int s = 0; s < COL_PADDING; s++) fputc(' ', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+// ---------- Horizontal Display (-x) ----------
+void print_horizontal_across(const char *path, struct file_entry *ents, int n) {
+    if (n == 0) return;
+    int term_width = get_terminal_width();
+    size_t maxlen = 0;
+    for (int i = 0; i < n; i++)
+        if (strlen(ents[i].name) > maxlen) maxlen = strlen(ents[i].name);
+    int col_width = (int)maxlen + COL_PADDING;
+    int current_width = 0;
+
+    for (int i = 0; i < n; i++) {
+        int needed = col_width;
+        if (current_width + needed > term_width) {
+            fputc('\n', out);
+            current_width = 0;
+        }
+        const char *color = get_color(path, &ents[i]);
+        fprintf(out, "%s%-*s%s", color, (int)maxlen, ents[i].name, RESET_COLOR);
+        current_width += needed;
+    }
+    fputc('\n', out);
+}
+
+// ---------- Print one directory's entries ----------
+void print_entries(const char *path, struct file_entry *ents, int n,
+                   int flag_l, int flag_C, int flag_x) {
+    if (flag_l)
+        print_long_listing(path, ents, n);
+    else if (flag_x)
+        print_horizontal_across(path, ents, n);
+    else if (flag_C)
+        print_down_then_across(path, ents, n);
+    else
+        for (int i = 0; i < n; i++) {
+            const char *color = get_color(path, &ents[i]);
+            fprintf(out, "%s%s%s\n", color, ents[i].name, RESET_COLOR);
+        }
+}
+
+// ---------- Subtree size totals (--total-size) ----------
+// Each directory's header carries the st_blocks and st_size of everything
+// listed below it. The sums are built bottom-up by do_ls() during the
+// same walk; to print them in the header, a directory's subdirectory
+// output is written to a memory stream first and emitted after the
+// directory's own listing. A file with several hard links is counted
+// once, through a set of (st_dev, st_ino).
+struct tree_total {
+    long long blocks;   // 512-byte units, as in st_blocks
+    long long bytes;
+};
+
+static int flag_total_size = 0;
+
+struct inode_key { dev_t dev; ino_t ino; };
+static struct inode_key *seen_inodes = NULL;   // open addressing, ino 0 = free
+static size_t seen_cap = 0, seen_used = 0;
+
+// Returns 1 the first time (dev, ino) is offered, 0 afterwards.
+static int inode_first_seen(dev_t dev, ino_t ino) {
+    if ((seen_used + 1) * 2 > seen_cap) {
+        size_t old_cap = seen_cap;
+        struct inode_key *old = seen_inodes;
+        seen_cap = old_cap ? old_cap * 2 : 1024;
+        seen_inodes = calloc(seen_cap, sizeof(*seen_inodes));
+        if (!seen_inodes) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        seen_used = 0;
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].ino) inode_first_seen(old[i].dev, old[i].ino);
+        free(old);
+    }
+    size_t h = (size_t)((ino * 0x9E3779B97F4A7C15ull) ^ dev) & (seen_cap - 1);
+    while (seen_inodes[h].ino) {
+        if (seen_inodes[h].ino == ino && seen_inodes[h].dev == dev) return 0;
+        h = (h + 1) & (seen_cap - 1);
+    }
+    seen_inodes[h].dev = dev;
+    seen_inodes[h].ino = ino;
+    seen_used++;
+    return 1;
+}
+
+static void reset_seen_inodes(void) {
+    free(seen_inodes);
+    seen_inodes = NULL;
+    seen_cap = seen_used = 0;
+}
+
+static void add_entry_size(const char *path, struct file_entry *e, struct tree_total *sum) {
+    const struct stat *st = entry_stat(path, e);
+    if (!st) return;
+    if (st->st_nlink > 1 && !S_ISDIR(st->st_mode) &&
+        !inode_first_seen(st->st_dev, st->st_ino))
+        return;
+    sum->blocks += st->st_blocks;
+    sum->bytes += st->st_size;
+}
+
+// ---------- Recursive Listing ----------
+// 'sum', if not NULL, receives the size of the subtree (--total-size).
+void do_ls(const char *path, int flag_l, int flag_C, int flag_x, int flag_R,
+           struct tree_total *sum) {
+    struct file_entry *ents = NULL;
+    if (flag_gitignore) gitignore_push(path);
+    int n = read_filenames(path, &ents);
+    if (n <= 0) {
+        if (flag_gitignore) gitignore_pop();
+        return;
+    }
+
+    struct tree_total total = {0, 0};
+    if (flag_total_size)
+        for (int i = 0; i < n; i++) add_entry_size(path, &ents[i], &total);
+
+    if (!flag_total_size) {
+        fprintf(out, "\n%s:\n", path);
+        print_entries(path, ents, n, flag_l, flag_C, flag_x);
+    }
+
+    // Recursive part
+    char *sub_buf = NULL;
+    size_t sub_len = 0;
+    FILE *parent_out = out;
+    if (flag_R) {
+        if (flag_total_size) {
+            out = open_memstream(&sub_buf, &sub_len);
+            if (!out) {
+                perror("open_memstream");
+                exit(EXIT_FAILURE);
+            }
+        }
+        char full[1024];
+        for (int i = 0; i < n; i++) {
+            // d_type answers "is it a directory?" without an lstat on
+            // filesystems that fill it in.
+            int is_dir;
+            if (ents[i].d_type != DT_UNKNOWN && !ents[i].has_stat) {
+                is_dir = ents[i].d_type == DT_DIR;
+            } else {
+                const struct stat *st = entry_stat(path, &ents[i]);
+                if (!st) continue;
+                is_dir = S_ISDIR(st->st_mode);
+            }
+            snprintf(full, sizeof(full), "%s/%s", path, ents[i].name);
+            if (is_dir &&
+                strcmp(ents[i].name, ".") != 0 &&
+                strcmp(ents[i].name, "..") != 0) {
+                do_ls(full, flag_l, flag_C, flag_x, flag_R, &total);
+            }
+        }
+    }
+
+    if (flag_total_size) {
+        if (flag_R) {
+            fclose(out);
+            out = parent_out;
+        }
+        // Blocks are shown in 1K units, as du and ls "total" do.
+        fprintf(out, "\n%s: total %lld blocks, %lld bytes\n",
+                path, total.blocks / 2, total.bytes);
+        print_entries(path, ents, n, flag_l, flag_C, flag_x);
+        fwrite(sub_buf, 1, sub_len, out);
+        free(sub_buf);
+        if (sum) {
+            sum->blocks += total.blocks;
+            sum->bytes += total.bytes;
+        }
+    }
+
+    free_names(ents, n);
+    if (flag_gitignore) gitignore_pop();
+}
+
+// ---------- Watch mode (--watch) ----------
+// Lists 'path' once, then keeps the entry table in memory and applies
+// inotify events to it: a created or moved-in name is inserted at its
+// sorted position, a deleted or moved-out name is removed, and a name
+// whose attributes or contents changed only has its cached stat dropped.
+// A redraw therefore re-stats only the entries that changed. If the
+// event queue overflows the directory is read again from scratch.
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE |              \
+                    IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_COALESCE_MS 50
+
+static int flag_watch = 0;
+static long stat_watch_events = 0, stat_watch_redraws = 0;
+
+// Binary search over the sorted table. Returns the index of 'name' or,
+// if absent, -(insertion point) - 1.
+static int find_entry(struct file_entry *ents, int n, const char *name) {
+    struct file_entry key = { .name = (char *)name };
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = cmp_names(&key, &ents[mid]);
+        if (c == 0) return mid;
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return -lo - 1;
+}
+
+static void watch_render(const char *path, struct file_entry *ents, int n,
+                         int flag_l, int flag_C, int flag_x) {
+    if (isatty(STDOUT_FILENO))
+        fprintf(out, "\033[H\033[2J");
+    fprintf(out, "\n%s:\n", path);
+    print_entries(path, ents, n, flag_l, flag_C, flag_x);
+    fflush(out);
+    stat_watch_redraws++;
+}
+
+void watch_ls(const char *path, int flag_l, int flag_C, int flag_x) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1 || inotify_add_watch(fd, path, WATCH_MASK) == -1) {
+        perror(path);
+        return;
+    }
+
+    struct file_entry *ents = NULL;
+    if (flag_gitignore) gitignore_push(path);
+    int n = read_filenames(path, &ents);
+    int cap = n;
+    watch_render(path, ents, n, flag_l, flag_C, flag_x);
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        int changed = 0, rescan = 0, gone = 0;
+
+        // Block for the first batch, then keep draining for a short while
+        // so a burst of events costs one redraw.
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int timeout = -1;
+        while (poll(&pfd, 1, timeout) > 0) {
+            ssize_t len = read(fd, buf, sizeof(buf));
+            if (len <= 0) break;
+            timeout = WATCH_COALESCE_MS;
+
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(*ev) + ev->len;
+                stat_watch_events++;
+
+                if (ev->mask & IN_Q_OVERFLOW) { rescan = 1; continue; }
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) { gone = 1; continue; }
+                if (ev->len == 0 || ev->name[0] == '.') continue;
+
+                int idx = find_entry(ents, n, ev->name);
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    if (idx < 0) continue;
+                    free(ents[idx].name);
+                    memmove(&ents[idx], &ents[idx + 1], sizeof(*ents) * (n - idx - 1));
+                    n--;
+                } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    unsigned char d_type = (ev->mask & IN_ISDIR) ? DT_DIR : DT_UNKNOWN;
+                    if (idx >= 0) {
+                        ents[idx].has_stat = 0;
+                        ents[idx].d_type = d_type;
+                    } else {
+                        if (entry_filtered(path, ev->name, d_type)) continue;
+                        idx = -idx - 1;
+                        if (n == cap) {
+                            cap = cap ? cap * 2 : INITIAL_FILES;
+                            struct file_entry *grown = realloc(ents, sizeof(*ents) * cap);
+                            if (!grown) {
+                                perror("realloc");
+                                exit(EXIT_FAILURE);
+                            }
+                            ents = grown;
+                        }
+                        memmove(&ents[idx + 1], &ents[idx], sizeof(*ents) * (n - idx));
+                        ents[idx].name = strdup(ev->name);
+                        ents[idx].d_type = d_type;
+                        ents[idx].has_stat = 0;
+                        n++;
+                    }
+                } else if (idx >= 0) {
+                    ents[idx].has_stat = 0;
+                }
+                changed = 1;
+            }
+        }
+
+        if (gone) break;
+        if (rescan) {
+            free_names(ents, n);
+            n = read_filenames(path, &ents);
+            cap = n;
+            changed = 1;
+        }
+        if (changed)
+            watch_render(path, ents, n, flag_l, flag_C, flag_x);
+    }
+
+    free_names(ents, n);
+    if (flag_gitignore) gitignore_pop();
+    close(fd);
+}
+
+// ---------- --stats report ----------
+void print_stats(double elapsed) {
+    fprintf(stderr, "elapsed: %.6f s\n", elapsed);
+    if (flag_gitignore)
+        fprintf(stderr, "gitignore: %ld files, %ld rules, %ld entries checked, "
+                        "%ld ignored, %.6f s matching\n",
+                stat_gi_files, stat_gi_rules, stat_gi_checked,
+                stat_gi_ignored, stat_gi_seconds);
+    if (flag_watch)
+        fprintf(stderr, "watch: %ld events, %ld redraws\n",
+                stat_watch_events, stat_watch_redraws);
+    if (cache_path || daemon_mode)
+        fprintf(stderr, "cache: %ld directories reused, %ld scanned\n",
+                stat_cache_hits, stat_cache_misses);
+}
+
+// ---------- Option handling ----------
+// Long-only options get values outside the char range.
+enum { OPT_GITIGNORE = 256, OPT_STATS, OPT_CACHE, OPT_WATCH, OPT_TOTAL_SIZE };
+
+// Puts every option back to its default. The daemon runs many requests
+// in one process, so state from the previous request must not leak.
+static void reset_options(void) {
+    free(ignore_list);
+    ignore_list = NULL;
+    ignore_count = 0;
+    flag_gitignore = flag_stats = flag_watch = flag_total_size = 0;
+    reset_seen_inodes();
+    stat_gi_files = stat_gi_rules = stat_gi_checked = stat_gi_ignored = 0;
+    stat_gi_seconds = 0;
+    stat_cache_hits = stat_cache_misses = 0;
+    stat_watch_events = stat_watch_redraws = 0;
+    optind = 0;     // glibc: fully re-initialise getopt
+}
+
+// Parses the listing options in 'argv' and produces the listing.
+int run_ls(int argc, char *argv[]) {
+    int flag_l = 0, flag_C = 0, flag_x = 0, flag_R = 0;
+    int opt;
+    static struct option long_opts[] = {
+        {"ignore", required_argument, 0, 'I'},
+        {"gitignore", no_argument, 0, OPT_GITIGNORE},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"cache", required_argument, 0, OPT_CACHE},
+        {"watch", no_argument, 0, OPT_WATCH},
+        {"total-size", no_argument, 0, OPT_TOTAL_SIZE},
+        {0, 0, 0, 0}
+    };
+    reset_options();
+    out = stdout;
+    while ((opt = getopt_long(argc, argv, "lCxRI:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'l': flag_l = 1; break;
+            case 'C': flag_C = 1; break;
+            case 'x': flag_x = 1; break;
+            case 'R': flag_R = 1; break;
+            case 'I': add_ignore_pattern(optarg); break;
+            case OPT_GITIGNORE: flag_gitignore = 1; break;
+            case OPT_STATS: flag_stats = 1; break;
+            case OPT_CACHE: cache_path = optarg; break;
+            case OPT_WATCH: flag_watch = 1; break;
+            case OPT_TOTAL_SIZE: flag_total_size = 1; break;
+            default: break;
+        }
+    }
+
+    if (daemon_mode && (cache_path || flag_watch)) {
+        fprintf(stderr, "ls: --cache and --watch are not available through --server\n");
+        cache_path = NULL;
+        return 2;
+    }
+
+    const char *path = ".";
+    if (optind < argc) path = argv[optind];
+
+    double start = flag_stats ? now_seconds() : 0;
+    if (cache_path) cache_load(cache_path);
+    if (flag_watch)
+        watch_ls(path, flag_l, flag_C, flag_x);
+    else
+        do_ls(path, flag_l, flag_C, flag_x, flag_R, NULL);
+    if (cache_path) cache_save(cache_path);
+    if (flag_stats) {
+        fflush(out);
+        print_stats(now_seconds() - start);
+    }
+    return 0;
+}
+
+// ---------- Listing daemon (--daemon=SOCKET / --server=SOCKET) ----------
+// The client connects to the daemon's UNIX socket and passes its own
+// stdout and stderr descriptors (SCM_RIGHTS) along with its working
+// directory and arguments. The daemon points fds 1 and 2 at them, runs
+// the request through run_ls() and replies with the exit status. Output
+// is therefore produced exactly as a normal run would produce it, tty
+// detection and terminal width included, while the name cache and the
+// directory cache stay warm between requests.
+//
+// Request: one sendmsg carrying the two fds and a uint32_t payload length,
+// then the payload "cwd\0arg1\0arg2\0...". Reply: one int32_t status.
+#define DAEMON_MAX_REQUEST (1 << 20)
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int socket_address(const char *sock_path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", sock_path);
+        return -1;
+    }
+    strcpy(addr->sun_path, sock_path);
+    return 0;
+}
+
+// Handles one connection. Errors only drop the connection.
+static void daemon_serve_one(int conn, int saved_out, int saved_err) {
+    uint32_t len;
+    int fds[2];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &len, sizeof(len) };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(len)) return;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return;
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    char *payload = NULL;
+    char **args = NULL;
+    if (len == 0 || len > DAEMON_MAX_REQUEST) goto out;
+    payload = malloc(len + 1);
+    if (!payload || read_full(conn, payload, len) == -1) goto out;
+    payload[len] = '\0';
+
+    // payload: cwd, then the arguments
+    int argc = 0;
+    for (uint32_t i = 0; i < len; i++)
+        if (payload[i] == '\0') argc++;
+    args = malloc(sizeof(*args) * (argc + 1));
+    if (!args) goto out;
+    char *p = payload;
+    const char *cwd = p;
+    p += strlen(p) + 1;
+    args[0] = "ls";
+    int n = 1;
+    while (p < payload + len) {
+        args[n++] = p;
+        p += strlen(p) + 1;
+    }
+    args[n] = NULL;
+
+    int32_t status = 2;
+    daemon_invalidate();
+    if (chdir(cwd) == 0) {
+        fflush(stdout);
+        fflush(stderr);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        status = run_ls(n, args);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+    }
+    write_full(conn, &status, sizeof(status));
+
+out:
+    free(args);
+    free(payload);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int run_daemon(const char *sock_path) {
+    struct sockaddr_un addr;
+    if (socket_address(sock_path, &addr) == -1) return 2;
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1) {
+        perror("socket");
+        return 2;
+    }
+    unlink(sock_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(lfd, 64) == -1) {
+        perror(sock_path);
+        close(lfd);
+        return 2;
+    }
+
+    daemon_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (daemon_inotify_fd == -1) {
+        perror("inotify_init1");
+        close(lfd);
+        return 2;
+    }
+    daemon_mode = 1;
+    cache_grow();
+    signal(SIGPIPE, SIG_IGN);   // a client going away must not kill us
+
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    for (;;) {
+        int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        daemon_serve_one(conn, saved_out, saved_err);
+        close(conn);
+    }
+    close(lfd);
+    return 2;
+}
+
+// Forwards argv (minus the --server option) to the daemon and returns
+// its exit status.
+int run_client(const char *sock_path, int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    if (socket_address(sock_path, &addr) == -1) return 2;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(sock_path);
+        return 2;
+    }
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("getcwd");
+        return 2;
+    }
+    size_t len = strlen(cwd) + 1;
+    for (int i = 1; i < argc; i++) len += strlen(argv[i]) + 1;
+    char *payload = malloc(len);
+    if (!payload) {
+        perror("malloc");
+        return 2;
+    }
+    char *p = payload;
+    p = stpcpy(p, cwd) + 1;
+    for (int i = 1; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+
+    uint32_t len32 = (uint32_t)len;
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct iovec iov = { &len32, sizeof(len32) };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int32_t status = 2;
+    if (sendmsg(fd, &msg, 0) != sizeof(len32) ||
+        write_full(fd, payload, len) == -1 ||
+        read_full(fd, &status, sizeof(status)) == -1) {
+        fprintf(stderr, "%s: daemon did not answer\n", sock_path);
+        status = 2;
+    }
+    free(payload);
+    close(fd);
+    return status;
+}
+
+// ---------- main ----------
+int main(int argc, char *argv[]) {
+    // --daemon and --server select how the program runs rather than what
+    // it lists, so they are picked out before normal option parsing.
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--daemon=", 9) == 0)
+            return run_daemon(argv[i] + 9);
+        if (strncmp(argv[i], "--server=", 9) == 0) {
+            const char *sock_path = argv[i] + 9;
+            memmove(&argv[i], &argv[i + 1], sizeof(*argv) * (argc - i));
+            return run_client(sock_path, argc - 1, argv);
+        }
+    }
+    return run_ls(argc, argv);
+}
@@ -0,0 +1,4017 @@
+/*
+ ============================================================================
+ Name        : ls-v1.31.0.c
+ Description : Feature 32 – Struct-of-Arrays Entry Table and Hardware Counters
+               Includes all previous features (1–31)
+ ============================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <locale.h>
+#include <wchar.h>
+#include <wctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "lsbin.h"
+
+#define COL_PADDING 2
+#define MIN_COLUMN_WIDTH (1 + COL_PADDING)
+#define DEFAULT_TERM_WIDTH 80
+#define INITIAL_FILES 256
+#define MAX_JOBS 64
+
+// Counters shared by worker threads are bumped without a lock.
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// Heap allocations on the listing paths go through counted_realloc(), so
+// the "mallocs" line of --stats covers every one of them.
+static long stat_mallocs = 0;
+
+static void *counted_realloc(void *old, size_t size) {
+    void *p = realloc(old, size);
+    if (!p) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    STAT_ADD(stat_mallocs, 1);
+    return p;
+}
+
+// ---------- Default colors ----------
+// Used when LS_COLORS is not set; same scheme as earlier versions.
+#define DEFAULT_LS_COLORS "di=0;34:ln=0;35:ex=0;32:bd=7:cd=7:so=7:" \
+                          "*.tar=0;31:*.tgz=0;31:*.gz=0;31:*.zip=0;31"
+
+// ---------- Output buffer ----------
+// All listing output goes through 'out', bypassing stdio. For standard
+// output it is a large buffer drained with write(2); a block produced
+// elsewhere (a worker's or a --total-size subtree's memory buffer) is
+// passed on with writev(2) together with what is pending, without being
+// copied. Memory buffers (fd == -1) just grow.
+//
+// SIGPIPE is ignored so that a closed reader shows up as EPIPE. That sets
+// output_closed, and the traversal checks it and stops at once. EPIPE is
+// only seen when a write is attempted, so a pipe buffer starts at
+// OUT_BUF_START and doubles after each write that succeeds, up to
+// OUT_BUF_PIPE: `ls -R | head` stops within a few KB of output instead of
+// walking on until a full megabyte is ready to write.
+#define OUT_BUF_TTY   (64 * 1024)
+#define OUT_BUF_PIPE  (1024 * 1024)
+#define OUT_BUF_START (4 * 1024)
+
+struct outbuf {
+    int fd;             // -1 for a memory buffer
+    char *data;
+    size_t len, cap;
+    size_t max_cap;     // a file buffer grows to this as writes succeed
+};
+
+static struct outbuf stdout_buf = { STDOUT_FILENO, NULL, 0, 0, 0 };
+static __thread struct outbuf *out;
+static int output_closed = 0;   // reader went away (EPIPE)
+static int output_error = 0;    // any other write failure
+
+static void out_fail(int err) {
+    if (err == EPIPE) {
+        __atomic_store_n(&output_closed, 1, __ATOMIC_RELAXED);
+    } else if (!output_error) {
+        output_error = 1;
+        errno = err;
+        perror("write error");
+    }
+}
+
+// Writes every byte described by 'iov', retrying on short writes.
+static void out_writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0 && !output_closed && !output_error) {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            out_fail(errno);
+            return;
+        }
+        while (cnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+void out_flush(struct outbuf *o) {
+    if (o->fd < 0 || o->len == 0) return;
+    struct iovec iov = { o->data, o->len };
+    out_writev_all(o->fd, &iov, 1);
+    o->len = 0;
+    if (o->cap < o->max_cap && !output_closed && !output_error) {
+        o->data = counted_realloc(o->data, o->cap * 2);
+        o->cap *= 2;
+    }
+}
+
+// Makes room for 'need' more bytes and returns where they go.
+static char *out_reserve(struct outbuf *o, size_t need) {
+    if (o->len + need > o->cap) {
+        if (o->fd >= 0 && o->len) out_flush(o);
+        if (o->len + need > o->cap) {
+            size_t cap = o->cap ? o->cap : 4096;
+            while (cap < o->len + need) cap *= 2;
+            o->data = counted_realloc(o->data, cap);
+            o->cap = cap;
+        }
+    }
+    return o->data + o->len;
+}
+
+void out_write(struct outbuf *o, const char *s, size_t len) {
+    if (!len) return;   // 's' may be the NULL data of an empty buffer
+    if (o->fd >= 0 && len >= o->cap / 2 && o->cap) {
+        // Large block: hand it to the kernel as is, behind what is pending.
+        struct iovec iov[2] = { { o->data, o->len }, { (char *)s, len } };
+        out_writev_all(o->fd, iov, 2);
+        o->len = 0;
+        return;
+    }
+    memcpy(out_reserve(o, len), s, len);
+    o->len += len;
+}
+
+void out_puts(struct outbuf *o, const char *s) {
+    out_write(o, s, strlen(s));
+}
+
+void out_putc(struct outbuf *o, char c) {
+    *out_reserve(o, 1) = c;
+    o->len++;
+}
+
+void out_printf(struct outbuf *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *p = out_reserve(o, 256);
+    int n = vsnprintf(p, o->cap - o->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= o->cap - o->len) {
+        p = out_reserve(o, (size_t)n + 1);
+        va_start(ap, fmt);
+        vsnprintf(p, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+    }
+    o->len += (size_t)n;
+}
+
+// Sets up the stdout buffer, sized for interactive or bulk use.
+static void out_init_stdout(void) {
+    int tty = isatty(STDOUT_FILENO);
+    size_t cap = tty ? OUT_BUF_TTY : OUT_BUF_START;
+    stdout_buf.max_cap = tty ? OUT_BUF_TTY : OUT_BUF_PIPE;
+    if (stdout_buf.cap != cap) {
+        free(stdout_buf.data);
+        stdout_buf.data = counted_realloc(NULL, cap);
+        stdout_buf.cap = cap;
+    }
+    stdout_buf.len = 0;
+    output_closed = output_error = 0;
+    out = &stdout_buf;
+}
+
+// ---------- Get terminal width ----------
+int get_terminal_width() {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0)
+        return DEFAULT_TERM_WIDTH;
+    return (int)w.ws_col;
+}
+
+// ---------- Directory entries ----------
+// A directory is held as an entry table: parallel arrays with one element
+// per entry, so each hot loop reads only the columns it needs. The sort
+// reads 'prefix', the column layout 'width', color selection 'mode' and
+// the name bytes. Names are stored back to back in one buffer and found
+// by offset. The full lstat() data, which only -l and the exports need,
+// stays in the cold 'ents' column; it is fetched lazily through
+// entry_stat(), or filled in up front when it comes from --cache.
+struct file_entry {
+    unsigned char d_type;   // DT_* from readdir, DT_UNKNOWN if not known
+    int has_stat;           // 'st' is valid
+    struct stat st;
+};
+
+struct arena;
+
+struct entry_table {
+    int n, cap;
+    char *names;            // every name, NUL-terminated, back to back
+    size_t names_len, names_cap;
+    size_t names_dead;      // bytes of removed names still in 'names'
+    uint32_t *name_off;     // start of each name in 'names'
+    uint32_t *name_len;
+    uint32_t *ext_off;      // just past the last '.', or name_len
+    uint64_t *prefix;       // first 8 bytes case-folded, big-endian
+    int *width;             // terminal columns the name occupies, as quoted
+    unsigned char *dirty;   // name has bytes the quoting style rewrites
+    uint32_t *mode;         // st_mode; 0 until stat'ed
+    int64_t *size;          // st_size, once stat'ed
+    int64_t *mtime;         // mtime in nanoseconds, once stat'ed
+    struct file_entry *ents;
+    struct arena *arena;    // where the columns live; NULL: malloc'd
+};
+
+static inline const char *table_name(const struct entry_table *t, int i) {
+    return t->names + t->name_off[i];
+}
+
+// Every per-entry column, for the code that moves whole rows.
+#define TABLE_COLUMNS 10
+
+struct table_column {
+    void **data;
+    size_t elem;
+};
+
+static void table_columns(struct entry_table *t, struct table_column *c) {
+    const struct table_column cols[TABLE_COLUMNS] = {
+        { (void **)&t->name_off, sizeof(*t->name_off) },
+        { (void **)&t->name_len, sizeof(*t->name_len) },
+        { (void **)&t->ext_off, sizeof(*t->ext_off) },
+        { (void **)&t->prefix, sizeof(*t->prefix) },
+        { (void **)&t->width, sizeof(*t->width) },
+        { (void **)&t->dirty, sizeof(*t->dirty) },
+        { (void **)&t->mode, sizeof(*t->mode) },
+        { (void **)&t->size, sizeof(*t->size) },
+        { (void **)&t->mtime, sizeof(*t->mtime) },
+        { (void **)&t->ents, sizeof(*t->ents) },
+    };
+    memcpy(c, cols, sizeof(cols));
+}
+
+// ---------- Name quoting (-q, -b, -N, --quoting-style) ----------
+// literal writes names as they are, with -q replacing non-printable
+// characters by '?' (the default on a terminal). escape (-b) writes
+// C-like backslash escapes, including "\ " for a space; c wraps every
+// name in double quotes with the same escapes. Names are checked once,
+// when read, with a scan 16 (SSE2) or 8 bytes at a time for control
+// bytes, bytes >= 0x80 and the style's special characters; clean names,
+// nearly all of them, are then written with a plain memcpy. Dirty ones
+// go through the escaper, which decodes them with mbrtowc(): a byte that
+// does not decode, or a character iswprint() rejects (C1 controls such
+// as U+009B), is written as octal escapes or as '?'.
+enum quoting_style { QUOTE_LITERAL, QUOTE_ESCAPE, QUOTE_C };
+
+static enum quoting_style quoting_style = QUOTE_LITERAL;
+static int flag_hide_control = -1;  // -q; -1 = only when stdout is a tty
+static int quoting_active = 0;      // resolved per run
+static char quote_special[2];       // extra bytes that need escaping
+
+#define QUOTED_MAX(len) (4 * (size_t)(len) + 2)
+
+static int has_special_bytes(const char *s, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i ctl = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+    const __m128i x1 = _mm_set1_epi8(quote_special[0]);
+    const __m128i x2 = _mm_set1_epi8(quote_special[1]);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v);     // v <= 0x1f
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, del));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, x1));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, x2));
+        if (_mm_movemask_epi8(_mm_or_si128(hit, v))) return 1;     // or v >= 0x80
+    }
+#endif
+    const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        uint64_t d = w ^ (ones * 0x7f);
+        uint64_t a = w ^ (ones * (unsigned char)quote_special[0]);
+        uint64_t b = w ^ (ones * (unsigned char)quote_special[1]);
+        // A byte below 0x20 or above 0x7f, or a zero byte in d, a or b,
+        // sets its high bit.
+        uint64_t hit = ((w - ones * 0x20) & ~w) | ((d - ones) & ~d) |
+                       ((a - ones) & ~a) | ((b - ones) & ~b) | w;
+        if (hit & highs) return 1;
+    }
+    for (; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c < 0x20 || c >= 0x7f || c == (unsigned char)quote_special[0] ||
+            c == (unsigned char)quote_special[1])
+            return 1;
+    }
+    return 0;
+}
+
+// Decodes the character at 's' for the escaper and returns its length.
+// *shown is set if it is printed as it is, with its width in *width. A
+// byte that does not decode, or a sequence cut short by the end of the
+// name, is a character of its own and not shown.
+static size_t quote_next(const char *s, size_t len, mbstate_t *ps, int *shown, int *width) {
+    unsigned char c = (unsigned char)*s;
+    *width = 1;
+    if (c < 0x80) {
+        *shown = c >= 0x20 && c != 0x7f;
+        return 1;
+    }
+    wchar_t wc;
+    size_t k = mbrtowc(&wc, s, len, ps);
+    if (k == (size_t)-1 || k == (size_t)-2 || k == 0) {
+        memset(ps, 0, sizeof(*ps));
+        *shown = 0;
+        return k == (size_t)-2 ? len : 1;   // a sequence cut short is one
+    }
+    *shown = iswprint((wint_t)wc);
+    int w = wcwidth(wc);
+    if (w >= 0) *width = w;
+    return k;
+}
+
+// Writes 'name' as the quoting style shows it; at most QUOTED_MAX(len).
+static char *put_quoted(char *p, const char *name, size_t len, int dirty) {
+    if (quoting_style == QUOTE_C) *p++ = '"';
+    if (!dirty) {
+        memcpy(p, name, len);
+        p += len;
+    } else {
+        mbstate_t ps;
+        memset(&ps, 0, sizeof(ps));
+        for (size_t i = 0; i < len; ) {
+            int shown, width;
+            size_t k = quote_next(name + i, len - i, &ps, &shown, &width);
+            unsigned char c = (unsigned char)name[i];
+            const char *esc = NULL;
+            if (quoting_style != QUOTE_LITERAL && c < 0x80) {
+                switch (c) {
+                    case '\a': esc = "\\a"; break;
+                    case '\b': esc = "\\b"; break;
+                    case '\f': esc = "\\f"; break;
+                    case '\n': esc = "\\n"; break;
+                    case '\r': esc = "\\r"; break;
+                    case '\t': esc = "\\t"; break;
+                    case '\v': esc = "\\v"; break;
+                    case '\\': esc = "\\\\"; break;
+                    case '"':  if (quoting_style == QUOTE_C) esc = "\\\""; break;
+                    case ' ':  if (quoting_style == QUOTE_ESCAPE) esc = "\\ "; break;
+                }
+            }
+            if (esc) {
+                memcpy(p, esc, 2);
+                p += 2;
+            } else if (shown) {
+                memcpy(p, name + i, k);
+                p += k;
+            } else if (quoting_style == QUOTE_LITERAL) {
+                *p++ = '?';
+            } else {
+                for (size_t b = i; b < i + k; b++) {
+                    c = (unsigned char)name[b];
+                    *p++ = '\\';
+                    *p++ = (char)('0' + (c >> 6));
+                    *p++ = (char)('0' + ((c >> 3) & 7));
+                    *p++ = (char)('0' + (c & 7));
+                }
+            }
+            i += k;
+        }
+    }
+    if (quoting_style == QUOTE_C) *p++ = '"';
+    return p;
+}
+
+// ---------- Display width ----------
+// Computed once per entry when it is read, so the column code never has
+// to measure a name again. All-ASCII names, nearly all of them in
+// practice, are recognised 16 (SSE2) or 8 bytes at a time and their
+// width is their length; only names with a byte >= 0x80 are decoded with
+// mbrtowc() and measured with wcwidth(). Undecodable bytes and
+// non-printable characters count as one column each.
+static int is_ascii(const char *s, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16)
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i))))
+            return 0;
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        if (w & 0x8080808080808080ull) return 0;
+    }
+    for (; i < len; i++)
+        if ((unsigned char)s[i] & 0x80) return 0;
+    return 1;
+}
+
+int name_display_width(const char *s, size_t len) {
+    if (is_ascii(s, len)) return (int)len;
+
+    mbstate_t ps;
+    memset(&ps, 0, sizeof(ps));
+    int width = 0;
+    while (len) {
+        wchar_t wc;
+        size_t k = mbrtowc(&wc, s, len, &ps);
+        if (k == (size_t)-1 || k == (size_t)-2) {
+            width++;                      // invalid or truncated byte
+            memset(&ps, 0, sizeof(ps));
+            k = 1;
+        } else {
+            if (k == 0) k = 1;
+            int w = wcwidth(wc);
+            width += w < 0 ? 1 : w;
+        }
+        s += k;
+        len -= k;
+    }
+    return width;
+}
+
+// Columns the escape for ASCII byte 'c' adds to the one it replaces.
+static int escape_extra(unsigned char c) {
+    switch (c) {
+        case '\a': case '\b': case '\f': case '\n':
+        case '\r': case '\t': case '\v': case '\\':
+            return 1;
+        case '"': return quoting_style == QUOTE_C;
+        case ' ': return quoting_style == QUOTE_ESCAPE;
+    }
+    return c < 0x20 || c == 0x7f ? 3 : 0;
+}
+
+// Width of 'name' as put_quoted() writes it, worked out from the name
+// itself with the same decoding, so nothing is written to measure it.
+static int quoted_width(const char *name, size_t len, int dirty) {
+    int width = quoting_style == QUOTE_C ? 2 : 0;
+    if (!dirty) return width + name_display_width(name, len);
+    mbstate_t ps;
+    memset(&ps, 0, sizeof(ps));
+    for (size_t i = 0; i < len; ) {
+        int shown, w;
+        size_t k = quote_next(name + i, len - i, &ps, &shown, &w);
+        unsigned char c = (unsigned char)name[i];
+        if (c < 0x80)
+            width += quoting_style == QUOTE_LITERAL ? 1 : 1 + escape_extra(c);
+        else if (shown)
+            width += w;
+        else
+            width += quoting_style == QUOTE_LITERAL ? 1 : 4 * (int)k;
+        i += k;
+    }
+    return width;
+}
+
+static long stat_lstat_calls = 0;
+
+// Copies the hot fields of entry i's freshly filled stat into their columns.
+static void table_note_stat(struct entry_table *t, int i) {
+    const struct stat *st = &t->ents[i].st;
+    t->mode[i] = st->st_mode;
+    t->size[i] = st->st_size;
+    t->mtime[i] = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Drops entry i's stat data, so the next use fetches it again.
+static void table_forget_stat(struct entry_table *t, int i) {
+    t->ents[i].has_stat = 0;
+    t->mode[i] = 0;
+}
+
+// Returns the lstat() data for entry i, fetching it on first use.
+const struct stat *entry_stat(const char *path, struct entry_table *t, int i) {
+    struct file_entry *e = &t->ents[i];
+    if (!e->has_stat) {
+        STAT_ADD(stat_lstat_calls, 1);
+        char full[1024];
+        snprintf(full, sizeof(full), "%s/%s", path, table_name(t, i));
+        if (lstat(full, &e->st) == -1) return NULL;
+        e->has_stat = 1;
+        table_note_stat(t, i);
+    }
+    return &e->st;
+}
+
+// ---------- Case-insensitive alphabetical sort ----------
+int cmp_names(const char *a, const char *b) {
+    int r = strcasecmp(a, b);
+    // Tie-break on the exact bytes so the order is total and entries can
+    // be found again by binary search (see --watch).
+    return r ? r : strcmp(a, b);
+}
+
+// The sort runs over a compact key table built from the prefix column.
+// Each 16-byte key holds the entry's index and the first 8 bytes of its
+// name, case-folded with the same tolower() strcasecmp() uses and packed
+// big-endian, so comparing two prefixes as integers orders them exactly
+// as cmp_names() would. Keys are radix-sorted on the prefix, which reads
+// no name at all; only runs of equal prefixes (names sharing their first
+// 8 folded bytes) are finished with cmp_names(). Below RADIX_MIN keys
+// the histograms cost more than they save, and the keys are compared
+// directly, prefix first. Every column is then permuted once.
+#define RADIX_MIN 64
+
+struct sort_key {
+    uint64_t prefix;
+    uint32_t idx;
+    uint32_t pad;
+};
+
+static unsigned char fold_table[256];
+static pthread_once_t fold_once = PTHREAD_ONCE_INIT;
+static __thread struct sort_key *sort_keys = NULL, *sort_tmp = NULL;
+static __thread struct file_entry *sort_scratch = NULL;  // widest column
+static __thread size_t sort_cap = 0;
+static long stat_sort_keys = 0, stat_sort_ties = 0;
+
+static void init_fold_table(void) {
+    for (int c = 0; c < 256; c++) fold_table[c] = (unsigned char)tolower(c);
+}
+
+// setlocale() again, after LC_ALL, LC_CTYPE or LANG changed (--daemon).
+static void reload_locale(void) {
+    setlocale(LC_CTYPE, "");
+    pthread_once(&fold_once, init_fold_table);
+    init_fold_table();
+}
+
+static int cmp_key_names(const void *a, const void *b, void *table) {
+    const struct entry_table *t = table;
+    return cmp_names(table_name(t, (int)((const struct sort_key *)a)->idx),
+                     table_name(t, (int)((const struct sort_key *)b)->idx));
+}
+
+static int cmp_keys(const void *a, const void *b, void *table) {
+    uint64_t pa = ((const struct sort_key *)a)->prefix;
+    uint64_t pb = ((const struct sort_key *)b)->prefix;
+    if (pa != pb) return pa < pb ? -1 : 1;
+    return cmp_key_names(a, b, table);
+}
+
+// Reorders one column into key order, through 'scratch'.
+static void permute_column(void *col, size_t elem, const struct sort_key *keys, int n,
+                           void *scratch) {
+    switch (elem) {
+        case 1:
+            for (int i = 0; i < n; i++)
+                ((uint8_t *)scratch)[i] = ((const uint8_t *)col)[keys[i].idx];
+            break;
+        case 4:
+            for (int i = 0; i < n; i++)
+                ((uint32_t *)scratch)[i] = ((const uint32_t *)col)[keys[i].idx];
+            break;
+        case 8:
+            for (int i = 0; i < n; i++)
+                ((uint64_t *)scratch)[i] = ((const uint64_t *)col)[keys[i].idx];
+            break;
+        default:
+            for (int i = 0; i < n; i++)
+                memcpy((char *)scratch + elem * i, (const char *)col + elem * keys[i].idx, elem);
+            break;
+    }
+    memcpy(col, scratch, elem * n);
+}
+
+void table_sort(struct entry_table *t) {
+    int n = t->n;
+    if (n < 2) return;
+    if ((size_t)n > sort_cap) {
+        free(sort_keys);
+        free(sort_tmp);
+        free(sort_scratch);
+        sort_cap = (size_t)n;
+        sort_keys = counted_realloc(NULL, sizeof(*sort_keys) * sort_cap);
+        sort_tmp = counted_realloc(NULL, sizeof(*sort_tmp) * sort_cap);
+        sort_scratch = counted_realloc(NULL, sizeof(*sort_scratch) * sort_cap);
+    }
+
+    struct sort_key *src = sort_keys;
+    if (n < RADIX_MIN) {
+        for (int i = 0; i < n; i++) {
+            sort_keys[i].prefix = t->prefix[i];
+            sort_keys[i].idx = (uint32_t)i;
+        }
+        qsort_r(sort_keys, n, sizeof(*sort_keys), cmp_keys, t);
+        goto permute;
+    }
+
+    // One pass over the prefix column builds the keys and the histograms
+    // of all 8 prefix bytes.
+    static __thread size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    const uint64_t *prefix = t->prefix;
+    for (int i = 0; i < n; i++) {
+        uint64_t p = prefix[i];
+        sort_keys[i].prefix = p;
+        sort_keys[i].idx = (uint32_t)i;
+        for (int b = 0; b < 8; b++) counts[b][(p >> (8 * b)) & 0xff]++;
+    }
+
+    // LSD radix sort, least significant byte first; a byte that is the
+    // same in every key (a common prefix, or padding) costs no pass.
+    struct sort_key *dst = sort_tmp;
+    for (int b = 0; b < 8; b++) {
+        size_t *c = counts[b];
+        if (c[(src[0].prefix >> (8 * b)) & 0xff] == (size_t)n) continue;
+        size_t pos = 0;
+        for (int v = 0; v < 256; v++) {
+            size_t k = c[v];
+            c[v] = pos;
+            pos += k;
+        }
+        for (int i = 0; i < n; i++)
+            dst[c[(src[i].prefix >> (8 * b)) & 0xff]++] = src[i];
+        struct sort_key *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    for (int i = 0; i < n; ) {
+        int j = i + 1;
+        while (j < n && src[j].prefix == src[i].prefix) j++;
+        if (j - i > 1) {
+            qsort_r(src + i, j - i, sizeof(*src), cmp_key_names, t);
+            STAT_ADD(stat_sort_ties, j - i);
+        }
+        i = j;
+    }
+
+permute:;
+    struct table_column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int c = 0; c < TABLE_COLUMNS; c++)
+        permute_column(*cols[c].data, cols[c].elem, src, n, sort_scratch);
+    STAT_ADD(stat_sort_keys, n);
+}
+
+// ---------- Color logic (LS_COLORS) ----------
+// --color: "auto" (the default) colors only when stdout is a terminal.
+// Without color a plain listing needs nothing but the names, so no
+// entry is ever stat'ed.
+enum color_mode { COLOR_NEVER, COLOR_ALWAYS, COLOR_AUTO };
+static enum color_mode color_mode = COLOR_AUTO;
+static int use_color = 0;   // resolved per run from color_mode
+
+// LS_COLORS is parsed once into complete escape sequences: one per file
+// type key ("di", "ln", "ex", ...) and one per "*.ext" rule. Extension
+// rules live in an open-addressing hash keyed by the lowercased text
+// after the last '.', which read time already located (ext_off), so a
+// lookup is one hash and one compare. Other suffix rules ("*~",
+// "*.tar.gz") are few and checked first, in order. A symlink is checked
+// for a target only when "or" is set or "ln" is "target" (color it as
+// whatever it points to); a link whose target is missing takes "or".
+enum color_type {
+    C_LC, C_RC, C_EC, C_RS, C_NO, C_FI, C_DI, C_LN, C_PI, C_SO,
+    C_BD, C_CD, C_OR, C_MI, C_EX, C_SU, C_SG, C_TW, C_OW, C_ST, C_COUNT
+};
+
+static const char color_keys[C_COUNT][3] = {
+    "lc", "rc", "ec", "rs", "no", "fi", "di", "ln", "pi", "so",
+    "bd", "cd", "or", "mi", "ex", "su", "sg", "tw", "ow", "st"
+};
+
+struct color_seq {
+    char *seq;          // NULL: print uncolored
+    size_t len;
+};
+
+struct ext_color {
+    char *ext;          // lowercased, NULL for a free slot
+    size_t len;
+    struct color_seq color;
+};
+
+struct suffix_color {
+    char *suffix;
+    size_t len;
+    struct color_seq color;
+};
+
+static struct color_seq type_colors[C_COUNT];
+static struct color_seq color_reset;
+static int link_as_target = 0;                  // ln=target
+static struct ext_color *ext_colors = NULL;     // open addressing
+static size_t ext_cap = 0;
+static struct suffix_color *suffix_colors = NULL;
+static int suffix_count = 0;
+static pthread_once_t colors_once = PTHREAD_ONCE_INIT;
+
+static size_t ext_hash(const char *s, size_t len) {
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)tolower((unsigned char)s[i])) * 16777619u;
+    return h;
+}
+
+// Wraps a raw LS_COLORS code into lc CODE rc.
+static struct color_seq make_color(const char *lc, const char *code, const char *rc) {
+    struct color_seq c = { NULL, 0 };
+    if (!code || !*code) return c;
+    c.len = strlen(lc) + strlen(code) + strlen(rc);
+    c.seq = malloc(c.len + 1);
+    if (!c.seq) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(c.seq, c.len + 1, "%s%s%s", lc, code, rc);
+    return c;
+}
+
+static void ext_insert(const char *ext, size_t len, struct color_seq color) {
+    size_t i = ext_hash(ext, len) & (ext_cap - 1);
+    while (ext_colors[i].ext &&
+           !(ext_colors[i].len == len && strncasecmp(ext_colors[i].ext, ext, len) == 0))
+        i = (i + 1) & (ext_cap - 1);
+    if (!ext_colors[i].ext) {
+        ext_colors[i].ext = strndup(ext, len);
+        for (size_t k = 0; k < len; k++)
+            ext_colors[i].ext[k] = (char)tolower((unsigned char)ext_colors[i].ext[k]);
+        ext_colors[i].len = len;
+    }
+    free(ext_colors[i].color.seq);  // a later rule overrides an earlier one
+    ext_colors[i].color = color;
+}
+
+static void init_colors(void) {
+    const char *env = getenv("LS_COLORS");
+    char *spec = strdup(env ? env : DEFAULT_LS_COLORS);
+    char *codes[C_COUNT] = {0};
+    if (!spec) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    // First pass: type keys, and a count to size the extension table.
+    int rules = 0;
+    for (char *item = spec; *item; ) {
+        char *end = strchr(item, ':');
+        if (end) *end = '\0';
+        char *eq = strchr(item, '=');
+        if (eq) {
+            *eq = '\0';
+            if (item[0] == '*') {
+                rules++;
+            } else {
+                for (int t = 0; t < C_COUNT; t++)
+                    if (strcmp(item, color_keys[t]) == 0) codes[t] = eq + 1;
+            }
+            *eq = '=';
+        }
+        if (!end) break;
+        item = end + 1;
+    }
+
+    const char *lc = codes[C_LC] ? codes[C_LC] : "\033[";
+    const char *rc = codes[C_RC] ? codes[C_RC] : "m";
+    link_as_target = codes[C_LN] && strcmp(codes[C_LN], "target") == 0;
+    if (link_as_target) codes[C_LN] = NULL;
+    for (int t = C_NO; t < C_COUNT; t++)
+        type_colors[t] = make_color(lc, codes[t], rc);
+    if (codes[C_EC]) {
+        color_reset.seq = strdup(codes[C_EC]);
+        color_reset.len = strlen(color_reset.seq);
+    } else {
+        color_reset = make_color(lc, codes[C_RS] ? codes[C_RS] : "0", rc);
+    }
+
+    // Second pass: "*..." rules (the string is now split on ':').
+    ext_cap = 16;
+    while (ext_cap < (size_t)rules * 2) ext_cap *= 2;
+    ext_colors = calloc(ext_cap, sizeof(*ext_colors));
+    suffix_colors = malloc(sizeof(*suffix_colors) * (rules ? rules : 1));
+    if (!ext_colors || !suffix_colors) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    char *end = spec + (env ? strlen(env) : strlen(DEFAULT_LS_COLORS));
+    for (char *item = spec; item < end; item += strlen(item) + 1) {
+        char *eq = strchr(item, '=');
+        if (item[0] != '*' || !eq) continue;
+        *eq = '\0';
+        const char *pat = item + 1;
+        size_t len = strlen(pat);
+        struct color_seq color = make_color(lc, eq + 1, rc);
+        if (len > 1 && pat[0] == '.' && !memchr(pat + 1, '.', len - 1) &&
+            !strpbrk(pat, "*?[")) {
+            ext_insert(pat + 1, len - 1, color);
+        } else {
+            suffix_colors[suffix_count].suffix = strdup(pat);
+            suffix_colors[suffix_count].len = len;
+            suffix_colors[suffix_count].color = color;
+            suffix_count++;
+        }
+    }
+    free(spec);
+}
+
+// Frees the parsed tables and parses LS_COLORS again. The daemon calls it
+// when a request's LS_COLORS differs from the previous one.
+static void reload_colors(void) {
+    pthread_once(&colors_once, init_colors);
+    for (int t = 0; t < C_COUNT; t++) free(type_colors[t].seq);
+    free(color_reset.seq);
+    for (size_t i = 0; i < ext_cap; i++) {
+        free(ext_colors[i].ext);
+        free(ext_colors[i].color.seq);
+    }
+    free(ext_colors);
+    for (int i = 0; i < suffix_count; i++) {
+        free(suffix_colors[i].suffix);
+        free(suffix_colors[i].color.seq);
+    }
+    free(suffix_colors);
+    memset(type_colors, 0, sizeof(type_colors));
+    memset(&color_reset, 0, sizeof(color_reset));
+    link_as_target = 0;
+    ext_colors = NULL;
+    ext_cap = 0;
+    suffix_colors = NULL;
+    suffix_count = 0;
+    init_colors();
+}
+
+// The suffix or extension rule for 'name', whose extension starts at
+// 'ext_off' (name_len if it has none).
+static const struct color_seq *name_color(const char *name, size_t name_len, size_t ext_off) {
+    for (int i = 0; i < suffix_count; i++) {
+        const struct suffix_color *sc = &suffix_colors[i];
+        if (name_len >= sc->len &&
+            strncasecmp(name + name_len - sc->len, sc->suffix, sc->len) == 0)
+            return &sc->color;
+    }
+    size_t len = name_len - ext_off;
+    if (len == 0 || ext_off == 0) return NULL;
+    const char *ext = name + ext_off;
+    size_t i = ext_hash(ext, len) & (ext_cap - 1);
+    while (ext_colors[i].ext) {
+        if (ext_colors[i].len == len && strncasecmp(ext_colors[i].ext, ext, len) == 0)
+            return &ext_colors[i].color;
+        i = (i + 1) & (ext_cap - 1);
+    }
+    return NULL;
+}
+
+static const struct color_seq *ext_color(const struct entry_table *t, int idx) {
+    return name_color(table_name(t, idx), t->name_len[idx], t->ext_off[idx]);
+}
+
+static const struct color_seq *type_color(int t) {
+    return type_colors[t].seq ? &type_colors[t] : NULL;
+}
+
+// Returns the color for entry i, or NULL to print it uncolored. Only the
+// mode column and the name are read once the entry has been stat'ed.
+const struct color_seq *get_color(const char *path, struct entry_table *t, int i) {
+    if (!use_color) return NULL;
+    pthread_once(&colors_once, init_colors);
+    if (!t->mode[i] && !entry_stat(path, t, i))
+        return type_color(C_MI);
+
+    mode_t m = t->mode[i];
+    char link[1024];        // with ln=target, the name the link points to
+    ssize_t link_len = -1;
+    if (S_ISLNK(m)) {
+        if (!link_as_target && !type_colors[C_OR].seq) return type_color(C_LN);
+        char full[1024];
+        struct stat target;
+        snprintf(full, sizeof(full), "%s/%s", path, table_name(t, i));
+        if (stat(full, &target) == -1)
+            return type_colors[C_OR].seq ? &type_colors[C_OR] : type_color(C_LN);
+        if (!link_as_target) return type_color(C_LN);
+        m = target.st_mode;
+        link_len = readlink(full, link, sizeof(link));
+    }
+    if (S_ISDIR(m)) {
+        if ((m & S_ISVTX) && (m & S_IWOTH) && type_colors[C_TW].seq) return &type_colors[C_TW];
+        if ((m & S_IWOTH) && type_colors[C_OW].seq) return &type_colors[C_OW];
+        if ((m & S_ISVTX) && type_colors[C_ST].seq) return &type_colors[C_ST];
+        return type_color(C_DI);
+    }
+    if (S_ISFIFO(m)) return type_color(C_PI);
+    if (S_ISSOCK(m)) return type_color(C_SO);
+    if (S_ISBLK(m))  return type_color(C_BD);
+    if (S_ISCHR(m))  return type_color(C_CD);
+    if (!S_ISREG(m)) return type_color(C_NO);
+    if ((m & S_ISUID) && type_colors[C_SU].seq) return &type_colors[C_SU];
+    if ((m & S_ISGID) && type_colors[C_SG].seq) return &type_colors[C_SG];
+    if ((m & (S_IXUSR | S_IXGRP | S_IXOTH)) && type_colors[C_EX].seq) return &type_colors[C_EX];
+    const struct color_seq *c;
+    if (link_len >= 0) {
+        const char *dot = memrchr(link, '.', (size_t)link_len);
+        c = name_color(link, (size_t)link_len, dot ? (size_t)(dot - link) + 1 : (size_t)link_len);
+    } else {
+        c = ext_color(t, i);
+    }
+    return c ? c : type_color(C_FI);
+}
+
+// ---------- Ignore patterns (--ignore / -I) ----------
+// Each pattern is classified once when it is added, so the common shapes
+// (".git", "node_modules", "build*", "*.tmp") are matched with a length
+// check and memcmp instead of a full fnmatch() per entry.
+enum ignore_kind { IGN_LITERAL, IGN_PREFIX, IGN_SUFFIX, IGN_CONTAINS, IGN_ALL, IGN_GLOB };
+
+struct ignore_pattern {
+    enum ignore_kind kind;
+    const char *text;   // literal part (or full pattern for IGN_GLOB)
+    size_t len;         // length of the literal part
+};
+
+static struct ignore_pattern *ignore_list = NULL;
+static int ignore_count = 0;
+
+static int has_glob_chars(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+            return 1;
+    return 0;
+}
+
+// Classifies 'pattern' into one of the matcher kinds above. The pattern
+// text is referenced, not copied, so it must outlive the compiled form.
+void compile_pattern(struct ignore_pattern *p, const char *pattern, size_t len) {
+    int lead  = (len > 0 && pattern[0] == '*');
+    int trail = (len > 1 && pattern[len - 1] == '*');
+    const char *body = pattern + lead;
+    size_t body_len = len - lead - trail;
+
+    if (len == 1 && lead) {
+        p->kind = IGN_ALL; p->text = pattern; p->len = 0;
+    } else if (has_glob_chars(body, body_len)) {
+        p->kind = IGN_GLOB; p->text = pattern; p->len = len;
+    } else if (lead && trail) {
+        p->kind = IGN_CONTAINS; p->text = body; p->len = body_len;
+    } else if (lead) {
+        p->kind = IGN_SUFFIX; p->text = body; p->len = body_len;
+    } else if (trail) {
+        p->kind = IGN_PREFIX; p->text = body; p->len = body_len;
+    } else {
+        p->kind = IGN_LITERAL; p->text = pattern; p->len = len;
+    }
+}
+
+int match_pattern(const struct ignore_pattern *p, const char *name, size_t len) {
+    switch (p->kind) {
+        case IGN_LITERAL:
+            return len == p->len && memcmp(name, p->text, len) == 0;
+        case IGN_PREFIX:
+            return len >= p->len && memcmp(name, p->text, p->len) == 0;
+        case IGN_SUFFIX:
+            return len >= p->len &&
+                   memcmp(name + len - p->len, p->text, p->len) == 0;
+        case IGN_CONTAINS:
+            return len >= p->len && memmem(name, len, p->text, p->len) != NULL;
+        case IGN_ALL:
+            return 1;
+        case IGN_GLOB:
+            return fnmatch(p->text, name, 0) == 0;
+    }
+    return 0;
+}
+
+void add_ignore_pattern(const char *pattern) {
+    struct ignore_pattern *grown =
+        realloc(ignore_list, sizeof(*ignore_list) * (ignore_count + 1));
+    if (!grown) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    ignore_list = grown;
+    compile_pattern(&ignore_list[ignore_count++], pattern, strlen(pattern));
+}
+
+// Returns 1 if 'name' (of length 'len') matches any --ignore pattern.
+int is_ignored(const char *name, size_t len) {
+    for (int i = 0; i < ignore_count; i++)
+        if (match_pattern(&ignore_list[i], name, len)) return 1;
+    return 0;
+}
+
+// ---------- .gitignore rule stack (--gitignore) ----------
+// Every directory visited with --gitignore has its .gitignore parsed once
+// and, if it holds any rules, pushed as a frame; the frame is popped when
+// do_ls() leaves the directory. Directories without rules push nothing,
+// and the stack grows as needed, so depth is never a limit. Rules are
+// checked innermost frame first and, within a frame, last rule first, so
+// the first hit is the one git would apply.
+struct gi_rule {
+    struct ignore_pattern pat;
+    int negate;     // "!pattern" re-includes
+    int dir_only;   // "pattern/" only matches directories
+    int anchored;   // contains a '/', matched against the path below the frame
+};
+
+struct gi_frame {
+    size_t base_len;        // strlen() of the directory owning the file
+    char *buf;              // file contents; rule texts point into it
+    struct gi_rule *rules;
+    int n;
+};
+
+static int flag_gitignore = 0;
+static int flag_stats = 0;
+static __thread struct gi_frame *gi_stack = NULL;
+static __thread int gi_depth = 0, gi_cap = 0;
+static __thread int gi_rules_active = 0;
+
+// Counters reported by --stats.
+static long stat_gi_files = 0, stat_gi_rules = 0;
+static long stat_gi_checked = 0, stat_gi_ignored = 0;
+static long stat_gi_nsec = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Splits 'buf' in place into rules. Returns the number of rules parsed.
+static int parse_gitignore(char *buf, struct gi_rule **out) {
+    int cap = 16, n = 0;
+    struct gi_rule *rules = counted_realloc(NULL, sizeof(*rules) * cap);
+
+    char *line = buf;
+    while (line && *line) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\r') line[--len] = '\0';
+        while (len && (line[len - 1] == ' ' || line[len - 1] == '\t') &&
+               !(len > 1 && line[len - 2] == '\\'))
+            line[--len] = '\0';
+
+        if (len == 0 || line[0] == '#') { line = next; continue; }
+
+        struct gi_rule r = {0};
+        char *pat = line;
+        if (pat[0] == '!') { r.negate = 1; pat++; len--; }
+        else if (pat[0] == '\\' && (pat[1] == '!' || pat[1] == '#')) { pat++; len--; }
+        if (len && pat[len - 1] == '/') { r.dir_only = 1; pat[--len] = '\0'; }
+        if (len >= 3 && strncmp(pat, "**/", 3) == 0) { pat += 3; len -= 3; }
+        else if (len && pat[0] == '/') { r.anchored = 1; pat++; len--; }
+        if (memchr(pat, '/', len)) r.anchored = 1;
+        if (len == 0) { line = next; continue; }
+
+        if (r.anchored) {
+            // Path patterns go straight to fnmatch(FNM_PATHNAME).
+            r.pat.kind = IGN_GLOB; r.pat.text = pat; r.pat.len = len;
+        } else {
+            compile_pattern(&r.pat, pat, len);
+        }
+
+        if (n == cap) {
+            cap *= 2;
+            rules = counted_realloc(rules, sizeof(*rules) * cap);
+        }
+        rules[n++] = r;
+        line = next;
+    }
+    *out = rules;
+    return n;
+}
+
+// Pushes a frame for 'path' if it has a .gitignore with rules. Returns 1
+// if it did; the caller pops only then.
+int gitignore_push(const char *path) {
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/.gitignore", path);
+    FILE *fp = fopen(file, "r");
+    if (!fp) return 0;
+
+    struct stat st;
+    char *buf = NULL;
+    struct gi_rule *rules = NULL;
+    int n = 0;
+    if (fstat(fileno(fp), &st) == 0 && st.st_size > 0) {
+        buf = counted_realloc(NULL, (size_t)st.st_size + 1);
+        size_t got = fread(buf, 1, (size_t)st.st_size, fp);
+        buf[got] = '\0';
+        n = parse_gitignore(buf, &rules);
+        STAT_ADD(stat_gi_files, 1);
+        STAT_ADD(stat_gi_rules, n);
+    }
+    fclose(fp);
+    if (n == 0) {
+        free(rules);
+        free(buf);
+        return 0;
+    }
+
+    if (gi_depth == gi_cap) {
+        gi_cap = gi_cap ? gi_cap * 2 : 16;
+        gi_stack = counted_realloc(gi_stack, sizeof(*gi_stack) * gi_cap);
+    }
+    struct gi_frame *f = &gi_stack[gi_depth++];
+    f->base_len = strlen(path);
+    f->buf = buf;
+    f->rules = rules;
+    f->n = n;
+    gi_rules_active += n;
+    return 1;
+}
+
+void gitignore_pop(void) {
+    struct gi_frame *f = &gi_stack[--gi_depth];
+    gi_rules_active -= f->n;
+    free(f->rules);
+    free(f->buf);
+}
+
+// Decides whether entry 'name' inside directory 'path' is ignored by the
+// rules currently on the stack. 'is_dir' is -1 if not yet known; it is
+// only resolved (via lstat) when a directory-only rule needs it.
+int gitignore_match(const char *path, const char *name, size_t len, int is_dir) {
+    char rel[1024];
+    size_t path_len = strlen(path);
+
+    for (int d = gi_depth - 1; d >= 0; d--) {
+        const struct gi_frame *f = &gi_stack[d];
+        for (int i = f->n - 1; i >= 0; i--) {
+            const struct gi_rule *r = &f->rules[i];
+            int hit;
+            if (r->anchored) {
+                // Path of the entry relative to the directory of this frame.
+                const char *below = path + f->base_len;
+                if (*below == '/') below++;
+                snprintf(rel, sizeof(rel), "%s%s%s",
+                         below, *below ? "/" : "", name);
+                hit = fnmatch(r->pat.text, rel, FNM_PATHNAME) == 0;
+            } else {
+                hit = match_pattern(&r->pat, name, len);
+            }
+            if (!hit) continue;
+            if (r->dir_only) {
+                if (is_dir < 0) {
+                    char full[1024];
+                    struct stat st;
+                    snprintf(full, sizeof(full), "%.*s/%s", (int)path_len, path, name);
+                    is_dir = lstat(full, &st) == 0 && S_ISDIR(st.st_mode);
+                }
+                if (!is_dir) continue;
+            }
+            return !r->negate;
+        }
+    }
+    return 0;
+}
+
+// Applies --ignore and --gitignore to one name. Returns 1 to drop it.
+int entry_filtered(const char *path, const char *name, unsigned char d_type) {
+    size_t len = strlen(name);
+    if (ignore_count && is_ignored(name, len))
+        return 1;
+    if (gi_rules_active) {
+        int is_dir = d_type == DT_UNKNOWN ? -1 : d_type == DT_DIR;
+        double t0 = flag_stats ? now_seconds() : 0;
+        int ignored = gitignore_match(path, name, len, is_dir);
+        if (flag_stats) STAT_ADD(stat_gi_nsec, (long)((now_seconds() - t0) * 1e9));
+        STAT_ADD(stat_gi_checked, 1);
+        if (ignored) { STAT_ADD(stat_gi_ignored, 1); return 1; }
+    }
+    return 0;
+}
+
+// ---------- Persistent directory cache (--cache=FILE) ----------
+// Each directory's raw listing (every non-hidden name, before --ignore and
+// --gitignore are applied) is recorded together with the lstat() data of
+// its entries, keyed by the directory's (st_dev, st_ino). On a later run a
+// directory whose mtime and ctime still match is served from the record
+// with no readdir and no per-entry lstat. Only the directory itself is
+// stat'ed, so changes to a file's own metadata that leave the directory
+// untouched are not noticed until the directory changes.
+//
+// File layout, host byte order:
+//   struct cache_file_header
+//   ndirs x { struct cache_dir_header,
+//             count x { struct cache_disk_entry, name bytes, '\0' } }
+// A file with a different magic, version or record size is ignored and
+// rewritten from scratch.
+#define CACHE_MAGIC   0x5849534cu   /* "LSIX" */
+#define CACHE_VERSION 1
+
+struct cache_file_header {
+    uint32_t magic, version, entry_size, ndirs;
+};
+
+struct cache_dir_header {
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint32_t count, pad;
+};
+
+struct cache_disk_entry {
+    uint64_t dev, ino, nlink, rdev, size, blocks;
+    int64_t atime_sec, atime_nsec, mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint32_t mode, uid, gid, blksize;
+    uint32_t name_len;
+    uint8_t d_type, has_stat, pad[2];
+};
+
+struct cache_dir {
+    struct cache_dir_header hdr;
+    struct cache_disk_entry *ents;
+    char **names;           // point into cache_file_buf or 'name_buf'
+    char *name_buf;         // the names of a record built by this run
+};
+
+static const char *cache_path = NULL;
+static char *cache_file_buf = NULL;
+static struct cache_dir *cache_table = NULL;   // open addressing
+static size_t cache_cap = 0, cache_used = 0;
+static int cache_dirty = 0;
+// Guards the table, the daemon's watch map and cache_dirty when several
+// operands are listed at once.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static long stat_cache_hits = 0, stat_cache_misses = 0;
+
+static size_t cache_slot(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino * 0x9E3779B97F4A7C15ull) ^ (dev * 0xC2B2AE3D27D4EB4Full);
+    return (size_t)(h ^ (h >> 29)) & (cache_cap - 1);
+}
+
+static struct cache_dir *cache_find_slot(uint64_t dev, uint64_t ino) {
+    size_t i = cache_slot(dev, ino);
+    while (cache_table[i].ents &&
+           !(cache_table[i].hdr.dev == dev && cache_table[i].hdr.ino == ino))
+        i = (i + 1) & (cache_cap - 1);
+    return &cache_table[i];
+}
+
+static void cache_grow(void) {
+    size_t old_cap = cache_cap;
+    struct cache_dir *old = cache_table;
+    cache_cap = old_cap ? old_cap * 2 : 64;
+    cache_table = calloc(cache_cap, sizeof(*cache_table));
+    if (!cache_table) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].ents)
+            *cache_find_slot(old[i].hdr.dev, old[i].hdr.ino) = old[i];
+    free(old);
+}
+
+static void cache_free_dir(struct cache_dir *cd) {
+    free(cd->name_buf);
+    free(cd->names);
+    free(cd->ents);
+}
+
+// Inserts 'cd', replacing any record for the same directory.
+static void cache_insert(const struct cache_dir *cd) {
+    if ((cache_used + 1) * 2 > cache_cap) cache_grow();
+    struct cache_dir *slot = cache_find_slot(cd->hdr.dev, cd->hdr.ino);
+    if (slot->ents) cache_free_dir(slot);
+    else cache_used++;
+    *slot = *cd;
+}
+
+static void stat_to_disk(const struct stat *st, struct cache_disk_entry *d) {
+    d->dev = st->st_dev;     d->ino = st->st_ino;
+    d->nlink = st->st_nlink; d->rdev = st->st_rdev;
+    d->size = st->st_size;   d->blocks = st->st_blocks;
+    d->atime_sec = st->st_atim.tv_sec; d->atime_nsec = st->st_atim.tv_nsec;
+    d->mtime_sec = st->st_mtim.tv_sec; d->mtime_nsec = st->st_mtim.tv_nsec;
+    d->ctime_sec = st->st_ctim.tv_sec; d->ctime_nsec = st->st_ctim.tv_nsec;
+    d->mode = st->st_mode;   d->uid = st->st_uid;
+    d->gid = st->st_gid;     d->blksize = st->st_blksize;
+}
+
+static void disk_to_stat(const struct cache_disk_entry *d, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = d->dev;     st->st_ino = d->ino;
+    st->st_nlink = d->nlink; st->st_rdev = d->rdev;
+    st->st_size = d->size;   st->st_blocks = d->blocks;
+    st->st_atim.tv_sec = d->atime_sec; st->st_atim.tv_nsec = d->atime_nsec;
+    st->st_mtim.tv_sec = d->mtime_sec; st->st_mtim.tv_nsec = d->mtime_nsec;
+    st->st_ctim.tv_sec = d->ctime_sec; st->st_ctim.tv_nsec = d->ctime_nsec;
+    st->st_mode = d->mode;   st->st_uid = d->uid;
+    st->st_gid = d->gid;     st->st_blksize = d->blksize;
+}
+
+// Loads the cache file into the table. A missing, truncated or foreign
+// file simply leaves the table empty.
+void cache_load(const char *file) {
+    cache_grow();
+    FILE *fp = fopen(file, "rb");
+    if (!fp) return;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1 || st.st_size < (off_t)sizeof(struct cache_file_header)) {
+        fclose(fp);
+        return;
+    }
+    cache_file_buf = malloc((size_t)st.st_size);
+    if (!cache_file_buf || fread(cache_file_buf, 1, (size_t)st.st_size, fp) != (size_t)st.st_size) {
+        fclose(fp);
+        free(cache_file_buf);
+        cache_file_buf = NULL;
+        return;
+    }
+    fclose(fp);
+
+    const char *p = cache_file_buf, *end = cache_file_buf + st.st_size;
+    struct cache_file_header fh;
+    memcpy(&fh, p, sizeof(fh));
+    p += sizeof(fh);
+    if (fh.magic != CACHE_MAGIC || fh.version != CACHE_VERSION ||
+        fh.entry_size != sizeof(struct cache_disk_entry))
+        return;
+
+    for (uint32_t d = 0; d < fh.ndirs; d++) {
+        struct cache_dir cd = {0};
+        if (end - p < (ptrdiff_t)sizeof(cd.hdr)) return;
+        memcpy(&cd.hdr, p, sizeof(cd.hdr));
+        p += sizeof(cd.hdr);
+        // Every entry takes at least its record and a NUL; a count the
+        // rest of the file cannot hold is corrupt, and it and everything
+        // after it are left to a real scan.
+        if ((uint64_t)cd.hdr.count * (sizeof(struct cache_disk_entry) + 1) >
+            (uint64_t)(end - p))
+            return;
+
+        cd.ents = malloc(sizeof(*cd.ents) * (cd.hdr.count ? cd.hdr.count : 1));
+        cd.names = malloc(sizeof(*cd.names) * (cd.hdr.count ? cd.hdr.count : 1));
+        if (!cd.ents || !cd.names) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = 0; i < cd.hdr.count; i++) {
+            if (end - p < (ptrdiff_t)sizeof(cd.ents[i])) { cache_free_dir(&cd); return; }
+            memcpy(&cd.ents[i], p, sizeof(cd.ents[i]));
+            p += sizeof(cd.ents[i]);
+            if ((size_t)(end - p) < (size_t)cd.ents[i].name_len + 1 ||
+                p[cd.ents[i].name_len] != '\0') {
+                cache_free_dir(&cd);
+                return;
+            }
+            cd.names[i] = (char *)p;
+            p += cd.ents[i].name_len + 1;
+        }
+        cache_insert(&cd);
+    }
+}
+
+// Writes the table back through a temporary file and rename(), so a
+// concurrent reader never sees a half-written cache.
+void cache_save(const char *file) {
+    if (!cache_dirty) return;
+
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", file, (long)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        perror(tmp);
+        return;
+    }
+
+    struct cache_file_header fh = {
+        CACHE_MAGIC, CACHE_VERSION, sizeof(struct cache_disk_entry), (uint32_t)cache_used
+    };
+    fwrite(&fh, sizeof(fh), 1, fp);
+    for (size_t s = 0; s < cache_cap; s++) {
+        const struct cache_dir *cd = &cache_table[s];
+        if (!cd->ents) continue;
+        fwrite(&cd->hdr, sizeof(cd->hdr), 1, fp);
+        for (uint32_t i = 0; i < cd->hdr.count; i++) {
+            fwrite(&cd->ents[i], sizeof(cd->ents[i]), 1, fp);
+            fwrite(cd->names[i], 1, cd->ents[i].name_len + 1, fp);
+        }
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, file) == -1) {
+        perror(file);
+        unlink(tmp);
+    }
+}
+
+// ---------- Daemon cache invalidation ----------
+// Under --daemon the cache table lives only in memory and every recorded
+// directory carries an inotify watch. Any event on the directory or one
+// of its entries marks the record stale, so no racy-timestamp guard is
+// needed. A watch does not see changes made inside a subdirectory (its
+// mtime, size, nlink) or through another hard link of a file, so the
+// stat data of directories and of entries with st_nlink > 1 is never
+// served from the record; those are lstat'ed again on every request.
+// 'daemon_wd_key' maps a watch descriptor back to the directory's
+// (dev, ino).
+static int daemon_mode = 0;
+static int daemon_inotify_fd = -1;
+static struct { uint64_t dev, ino; } *daemon_wd_key = NULL;
+static int daemon_wd_cap = 0;
+
+#define DAEMON_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Watches 'path' before it is read. Returns 0 if the listing must not be
+// recorded because no watch could be placed (e.g. the inotify limit).
+static int daemon_watch_dir(const char *path, const struct stat *dirst) {
+    int wd = inotify_add_watch(daemon_inotify_fd, path, DAEMON_WATCH_MASK);
+    if (wd < 0) return 0;
+    if (wd >= daemon_wd_cap) {
+        int cap = daemon_wd_cap ? daemon_wd_cap : 64;
+        while (cap <= wd) cap *= 2;
+        void *grown = realloc(daemon_wd_key, sizeof(*daemon_wd_key) * cap);
+        if (!grown) return 0;
+        daemon_wd_key = grown;
+        daemon_wd_cap = cap;
+    }
+    daemon_wd_key[wd].dev = dirst->st_dev;
+    daemon_wd_key[wd].ino = dirst->st_ino;
+    return 1;
+}
+
+// Applies all pending inotify events to the cache table.
+static void daemon_invalidate(void) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(daemon_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Lost events: nothing recorded can be trusted.
+                for (size_t i = 0; i < cache_cap; i++)
+                    if (cache_table[i].ents) cache_table[i].hdr.mtime_sec = -1;
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= daemon_wd_cap) continue;
+            struct cache_dir *cd = cache_find_slot(daemon_wd_key[ev->wd].dev,
+                                                   daemon_wd_key[ev->wd].ino);
+            if (cd->ents) cd->hdr.mtime_sec = -1;   // fails every lookup
+        }
+    }
+}
+
+// Returns the record for directory 'dirst' if it is still valid.
+static struct cache_dir *cache_lookup(const struct stat *dirst) {
+    struct cache_dir *cd = cache_find_slot(dirst->st_dev, dirst->st_ino);
+    if (!cd->ents ||
+        cd->hdr.mtime_sec != dirst->st_mtim.tv_sec ||
+        cd->hdr.mtime_nsec != dirst->st_mtim.tv_nsec ||
+        cd->hdr.ctime_sec != dirst->st_ctim.tv_sec ||
+        cd->hdr.ctime_nsec != dirst->st_ctim.tv_nsec)
+        return NULL;
+    return cd;
+}
+
+// ---------- Per-thread arena ----------
+// Everything a directory needs while it is listed (the entry array and
+// the names) is bump-allocated from the traversal thread's arena. A
+// directory takes a mark before reading and releases it when done; since
+// -R finishes a subdirectory before its parent, marks nest like a stack.
+// Releasing only rewinds: chunks are kept and reused by the next
+// directory, so in steady state a walk makes no malloc calls at all.
+#define ARENA_CHUNK (256 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    max_align_t data[];
+};
+
+struct arena {
+    struct arena_chunk *head;   // first chunk
+    struct arena_chunk *cur;    // chunk being filled, NULL before the first
+};
+
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+
+static __thread struct arena walk_arena;
+static long stat_arena_dirs = 0, stat_arena_allocs = 0;
+
+static void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    STAT_ADD(stat_arena_allocs, 1);
+    if (a->cur && a->cur->size - a->cur->used >= size) {
+        void *p = (char *)a->cur->data + a->cur->used;
+        a->cur->used += size;
+        return p;
+    }
+    // Move on to the next retained chunk if it is big enough, else
+    // insert a new one after the current chunk.
+    struct arena_chunk *next = a->cur ? a->cur->next : a->head;
+    if (!next || next->size < size) {
+        size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        struct arena_chunk *c = counted_realloc(NULL, sizeof(*c) + cap);
+        c->size = cap;
+        c->next = next;
+        if (a->cur) a->cur->next = c;
+        else a->head = c;
+        next = c;
+    }
+    next->used = size;
+    a->cur = next;
+    return next->data;
+}
+
+static char *arena_strndup(struct arena *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+static struct arena_mark arena_mark(const struct arena *a) {
+    struct arena_mark m = { a->cur, a->cur ? a->cur->used : 0 };
+    return m;
+}
+
+static void arena_release(struct arena *a, struct arena_mark m) {
+    a->cur = m.chunk;
+    if (m.chunk) m.chunk->used = m.used;
+}
+
+static void arena_destroy(struct arena *a) {
+    while (a->head) {
+        struct arena_chunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->cur = NULL;
+}
+
+// ---------- Entry table ----------
+// With an arena the columns and the name buffer come from it and are
+// released with it; without one (--watch, whose entries change one at a
+// time) they are malloc'd and given back through table_free(). Growing
+// in an arena copies to a fresh block and leaves the old one to the
+// release.
+static void table_init(struct entry_table *t, struct arena *a) {
+    memset(t, 0, sizeof(*t));
+    t->arena = a;
+    pthread_once(&fold_once, init_fold_table);
+}
+
+static void *table_resize(struct entry_table *t, void *old, size_t old_size, size_t size) {
+    if (t->arena) {
+        void *grown = arena_alloc(t->arena, size);
+        if (old_size) memcpy(grown, old, old_size);
+        return grown;
+    }
+    return counted_realloc(old, size);
+}
+
+// Makes room for 'rows' entries and 'name_bytes' more bytes of names.
+static void table_reserve(struct entry_table *t, int rows, size_t name_bytes) {
+    if (rows > t->cap) {
+        int cap = t->cap ? t->cap * 2 : rows;
+        while (cap < rows) cap *= 2;
+        struct table_column cols[TABLE_COLUMNS];
+        table_columns(t, cols);
+        for (int c = 0; c < TABLE_COLUMNS; c++)
+            *cols[c].data = table_resize(t, *cols[c].data, cols[c].elem * t->cap,
+                                         cols[c].elem * cap);
+        t->cap = cap;
+    }
+    if (t->names_len + name_bytes > t->names_cap) {
+        size_t cap = t->names_cap ? t->names_cap * 2 : 16 * (size_t)t->cap;
+        while (cap < t->names_len + name_bytes) cap *= 2;
+        t->names = table_resize(t, t->names, t->names_len, cap);
+        t->names_cap = cap;
+    }
+}
+
+// Appends an entry named 'name' (not NUL-terminated) and fills in its
+// name columns. The stat columns stay empty until entry_stat().
+// 'expect' sizes the first allocation. Returns the new row.
+static int table_add(struct entry_table *t, const char *name, size_t len,
+                     unsigned char d_type, int expect) {
+    table_reserve(t, t->n ? t->n + 1 : expect, len + 1);
+    int i = t->n++;
+    char *copy = t->names + t->names_len;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    t->name_off[i] = (uint32_t)t->names_len;
+    t->names_len += len + 1;
+    t->name_len[i] = (uint32_t)len;
+    const char *dot = memrchr(copy, '.', len);
+    t->ext_off[i] = dot ? (uint32_t)(dot - copy) + 1 : (uint32_t)len;
+
+    uint64_t prefix = 0;
+    for (size_t k = 0; k < 8; k++)
+        prefix = (prefix << 8) | (k < len ? fold_table[(unsigned char)copy[k]] : 0);
+    t->prefix[i] = prefix;
+
+    t->dirty[i] = quoting_active && has_special_bytes(copy, len);
+    t->width[i] = quoted_width(copy, len, t->dirty[i]);
+    t->mode[i] = 0;
+    t->size[i] = 0;
+    t->mtime[i] = 0;
+    t->ents[i].d_type = d_type;
+    t->ents[i].has_stat = 0;
+    return i;
+}
+
+// Moves the last row to position 'at', shifting the rows after it down.
+static void table_move_last(struct entry_table *t, int at) {
+    int last = t->n - 1;
+    struct table_column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int c = 0; c < TABLE_COLUMNS; c++) {
+        char *col = *cols[c].data, saved[sizeof(struct file_entry)];
+        size_t elem = cols[c].elem;
+        memcpy(saved, col + elem * last, elem);
+        memmove(col + elem * (at + 1), col + elem * at, elem * (last - at));
+        memcpy(col + elem * at, saved, elem);
+    }
+}
+
+// Copies the live names into a fresh buffer, dropping removed ones.
+static void table_compact_names(struct entry_table *t) {
+    char *fresh = t->arena ? arena_alloc(t->arena, t->names_cap)
+                           : counted_realloc(NULL, t->names_cap);
+    size_t len = 0;
+    for (int i = 0; i < t->n; i++) {
+        memcpy(fresh + len, table_name(t, i), t->name_len[i] + 1);
+        t->name_off[i] = (uint32_t)len;
+        len += t->name_len[i] + 1;
+    }
+    if (!t->arena) free(t->names);
+    t->names = fresh;
+    t->names_len = len;
+    t->names_dead = 0;
+}
+
+// Removes row i. Its name bytes stay in the buffer until removed names
+// outweigh the live ones; then the buffer is compacted, so a long --watch
+// on a busy directory stays bounded.
+static void table_remove(struct entry_table *t, int i) {
+    t->names_dead += t->name_len[i] + 1;
+    struct table_column cols[TABLE_COLUMNS];
+    table_columns(t, cols);
+    for (int c = 0; c < TABLE_COLUMNS; c++) {
+        char *col = *cols[c].data;
+        size_t elem = cols[c].elem;
+        memmove(col + elem * i, col + elem * (i + 1), elem * (t->n - i - 1));
+    }
+    t->n--;
+    if (t->names_dead > t->names_len - t->names_dead) table_compact_names(t);
+}
+
+// Frees a table that was built without an arena.
+static void table_free(struct entry_table *t) {
+    if (!t->arena) {
+        struct table_column cols[TABLE_COLUMNS];
+        table_columns(t, cols);
+        for (int c = 0; c < TABLE_COLUMNS; c++) free(*cols[c].data);
+        free(t->names);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+// ---------- Read filenames ----------
+static int flag_unsorted = 0;   // -U: keep readdir order
+
+// Builds the entry table for 'path' from a validated cache record.
+static int entries_from_cache(const char *path, const struct cache_dir *cd,
+                              struct entry_table *t) {
+    for (uint32_t i = 0; i < cd->hdr.count; i++) {
+        const struct cache_disk_entry *d = &cd->ents[i];
+        if (entry_filtered(path, cd->names[i], d->d_type)) continue;
+        int r = table_add(t, cd->names[i], d->name_len, d->d_type, (int)cd->hdr.count);
+        if (d->has_stat && !(daemon_mode && (S_ISDIR(d->mode) || d->nlink > 1))) {
+            disk_to_stat(d, &t->ents[r].st);
+            t->ents[r].has_stat = 1;
+            table_note_stat(t, r);
+        }
+    }
+    if (!flag_unsorted) table_sort(t);
+    return t->n;
+}
+
+// Fills 't' (taking columns from 'a', or malloc if NULL) with the entries
+// of 'path', sorted unless -U. Returns the number of entries.
+int read_filenames(const char *path, struct entry_table *t, struct arena *a) {
+    table_init(t, a);
+    struct stat dirst;
+    int caching = (cache_path || daemon_mode) && stat(path, &dirst) == 0;
+    if (caching) {
+        pthread_mutex_lock(&cache_lock);
+        struct cache_dir *cd = cache_lookup(&dirst);
+        if (cd) {
+            int n = entries_from_cache(path, cd, t);
+            pthread_mutex_unlock(&cache_lock);
+            STAT_ADD(stat_cache_hits, 1);
+            return n;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        STAT_ADD(stat_cache_misses, 1);
+    }
+
+    int watched = 0;
+    if (caching && daemon_mode) {
+        pthread_mutex_lock(&cache_lock);
+        watched = daemon_watch_dir(path, &dirst);
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return 0;
+    }
+
+    // With --cache every name is kept for the record, filtered or not,
+    // in one growing buffer; 'raw_of' maps each listed entry back to its
+    // raw position.
+    struct cache_dir rec = {0};
+    int raw_cap = 0, *raw_of = NULL;
+    size_t rec_names_len = 0, rec_names_cap = 0;
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        if (caching) {
+            if ((int)rec.hdr.count == raw_cap) {
+                raw_cap = raw_cap ? raw_cap * 2 : INITIAL_FILES;
+                rec.ents = counted_realloc(rec.ents, sizeof(*rec.ents) * raw_cap);
+                raw_of = counted_realloc(raw_of, sizeof(*raw_of) * raw_cap);
+            }
+            struct cache_disk_entry *d = &rec.ents[rec.hdr.count++];
+            memset(d, 0, sizeof(*d));
+            d->name_len = strlen(entry->d_name);
+            d->d_type = entry->d_type;
+            if (rec_names_len + d->name_len + 1 > rec_names_cap) {
+                rec_names_cap = rec_names_cap ? rec_names_cap * 2 : 16 * (size_t)raw_cap;
+                while (rec_names_cap < rec_names_len + d->name_len + 1) rec_names_cap *= 2;
+                rec.name_buf = counted_realloc(rec.name_buf, rec_names_cap);
+            }
+            memcpy(rec.name_buf + rec_names_len, entry->d_name, d->name_len + 1);
+            rec_names_len += d->name_len + 1;
+        }
+        // Pruned here, straight off the readdir buffer: an ignored entry is
+        // never copied or stat'ed, and an ignored directory never opened.
+        if (entry_filtered(path, entry->d_name, entry->d_type))
+            continue;
+        table_add(t, entry->d_name, strlen(entry->d_name), entry->d_type, INITIAL_FILES);
+        if (caching) raw_of[count] = rec.hdr.count - 1;
+        count++;
+    }
+    closedir(dir);
+
+    if (caching) {
+        // Populate the record so the next run needs no per-entry lstat.
+        for (int i = 0; i < count; i++) {
+            struct cache_disk_entry *d = &rec.ents[raw_of[i]];
+            if (entry_stat(path, t, i)) {
+                stat_to_disk(&t->ents[i].st, d);
+                d->has_stat = 1;
+            }
+        }
+        free(raw_of);
+
+        // A directory modified within the last second could change again
+        // without its timestamp moving; leave it out rather than risk a
+        // stale hit.
+        rec.hdr.dev = dirst.st_dev;
+        rec.hdr.ino = dirst.st_ino;
+        rec.hdr.mtime_sec = dirst.st_mtim.tv_sec;
+        rec.hdr.mtime_nsec = dirst.st_mtim.tv_nsec;
+        rec.hdr.ctime_sec = dirst.st_ctim.tv_sec;
+        rec.hdr.ctime_nsec = dirst.st_ctim.tv_nsec;
+        if (daemon_mode ? watched : dirst.st_mtime < time(NULL) - 1) {
+            if (!rec.ents) rec.ents = counted_realloc(NULL, sizeof(*rec.ents));
+            // The buffer has stopped moving; point the names into it.
+            rec.names = counted_realloc(NULL, sizeof(*rec.names) *
+                                              (rec.hdr.count ? rec.hdr.count : 1));
+            char *name = rec.name_buf;
+            for (uint32_t i = 0; i < rec.hdr.count; name += rec.ents[i++].name_len + 1)
+                rec.names[i] = name;
+            pthread_mutex_lock(&cache_lock);
+            cache_insert(&rec);
+            cache_dirty = 1;
+            pthread_mutex_unlock(&cache_lock);
+        } else {
+            cache_free_dir(&rec);
+        }
+    }
+
+    if (!flag_unsorted) table_sort(t);
+    return count;
+}
+
+// ---------- uid/gid name cache ----------
+// Open-addressing table per kind, grown as needed and never evicted, so a
+// returned name stays valid for the life of the process. A directory
+// rarely has more than a handful of owners, so almost every lookup after
+// the first is a hit, and under --daemon the tables stay warm across
+// requests. getpwuid()/getgrgid() are not thread-safe; the lock covers
+// them as well as the table.
+//
+// --id-files seeds both tables from /etc/passwd and /etc/group in one
+// read each, so with NSS backed by LDAP/SSSD only ids missing from the
+// local files still cost a lookup.
+#define PASSWD_FILE "/etc/passwd"
+#define GROUP_FILE  "/etc/group"
+
+struct id_name {
+    int used;
+    unsigned id;
+    const char *name;   // "?" if the id has no name
+};
+
+struct id_table {
+    struct id_name *slots;
+    size_t cap, used;
+};
+
+static struct id_table uid_names, gid_names;
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+static int flag_id_files = 0;
+static int flag_numeric = 0;    // -n: print raw ids, never call NSS
+static int id_files_loaded = 0;
+static long stat_uid_lookups = 0, stat_uid_hits = 0;
+static long stat_gid_lookups = 0, stat_gid_hits = 0;
+static long stat_nss_calls = 0;
+
+static struct id_name *id_slot(struct id_table *t, unsigned id) {
+    size_t i = (id * 2654435761u) & (t->cap - 1);
+    while (t->slots[i].used && t->slots[i].id != id)
+        i = (i + 1) & (t->cap - 1);
+    return &t->slots[i];
+}
+
+static void id_grow(struct id_table *t) {
+    struct id_table old = *t;
+    t->cap = old.cap ? old.cap * 2 : 64;
+    t->slots = calloc(t->cap, sizeof(*t->slots));
+    if (!t->slots) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old.cap; i++)
+        if (old.slots[i].used) *id_slot(t, old.slots[i].id) = old.slots[i];
+    free(old.slots);
+}
+
+// Adds 'id' -> 'name' unless the id is already known (the first line
+// for an id wins, as with getpwuid()). Called with id_lock held.
+static void id_insert(struct id_table *t, unsigned id, const char *name) {
+    if ((t->used + 1) * 2 > t->cap) id_grow(t);
+    struct id_name *c = id_slot(t, id);
+    if (c->used) return;
+    c->used = 1;
+    c->id = id;
+    c->name = strcpy(counted_realloc(NULL, strlen(name) + 1), name);
+    t->used++;
+}
+
+// Reads "name:password:id:..." lines from 'file' into 't'.
+static void id_load_file(struct id_table *t, const char *file) {
+    FILE *fp = fopen(file, "r");
+    if (!fp) return;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1) {
+        char *c1 = strchr(line, ':');
+        char *c2 = c1 ? strchr(c1 + 1, ':') : NULL;
+        if (!c2 || line[0] == '+' || line[0] == '-' || c1 == line) continue;
+        char *end;
+        errno = 0;
+        unsigned long id = strtoul(c2 + 1, &end, 10);
+        if (errno || end == c2 + 1 || *end != ':' || id > UINT_MAX) continue;
+        *c1 = '\0';
+        id_insert(t, (unsigned)id, line);
+    }
+    free(line);
+    fclose(fp);
+}
+
+static const char *id_lookup(struct id_table *t, unsigned id, int is_group) {
+    pthread_mutex_lock(&id_lock);
+    if (flag_id_files && !id_files_loaded) {
+        id_load_file(&uid_names, PASSWD_FILE);
+        id_load_file(&gid_names, GROUP_FILE);
+        id_files_loaded = 1;
+    }
+    if (is_group) stat_gid_lookups++;
+    else stat_uid_lookups++;
+    if ((t->used + 1) * 2 > t->cap) id_grow(t);
+    struct id_name *c = id_slot(t, id);
+    if (c->used) {
+        if (is_group) stat_gid_hits++;
+        else stat_uid_hits++;
+    } else {
+        const char *name = NULL;
+        stat_nss_calls++;
+        if (is_group) {
+            struct group *gr = getgrgid(id);
+            if (gr) name = strcpy(counted_realloc(NULL, strlen(gr->gr_name) + 1), gr->gr_name);
+        } else {
+            struct passwd *pw = getpwuid(id);
+            if (pw) name = strcpy(counted_realloc(NULL, strlen(pw->pw_name) + 1), pw->pw_name);
+        }
+        c->used = 1;
+        c->id = id;
+        c->name = name ? name : "?";
+        t->used++;
+    }
+    const char *name = c->name;
+    pthread_mutex_unlock(&id_lock);
+    return name;
+}
+
+const char *uid_to_name(uid_t uid) { return id_lookup(&uid_names, uid, 0); }
+const char *gid_to_name(gid_t gid) { return id_lookup(&gid_names, gid, 1); }
+
+// ---------- Long-listing line formatter ----------
+// A -l line is assembled in a per-thread buffer and appended to the
+// output in one call. The nine rwx characters come from a table indexed by the low
+// nine mode bits, and numbers are converted two digits at a time.
+static char perm_table[512][9];
+static pthread_once_t perm_table_once = PTHREAD_ONCE_INIT;
+static long stat_long_entries = 0;
+
+static void init_perm_table(void) {
+    for (int m = 0; m < 512; m++)
+        for (int b = 0; b < 9; b++)
+            perm_table[m][b] = (m & (0400 >> b)) ? "rwxrwxrwx"[b] : '-';
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes 'v' in decimal right-aligned in a field of at least 'width'
+// characters. Returns the end of the written text.
+static char *put_uint(char *p, unsigned long long v, int width) {
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
+    while (v >= 100) {
+        const char *d = &digit_pairs[(v % 100) * 2];
+        v /= 100;
+        *--t = d[1];
+        *--t = d[0];
+    }
+    if (v >= 10) {
+        *--t = digit_pairs[v * 2 + 1];
+        *--t = digit_pairs[v * 2];
+    } else {
+        *--t = (char)('0' + v);
+    }
+    int len = (int)(tmp + sizeof(tmp) - t);
+    for (; len < width; width--) *p++ = ' ';
+    memcpy(p, t, (size_t)len);
+    return p + len;
+}
+
+static __thread char *line_buf = NULL;
+static __thread size_t line_cap = 0;
+
+static char *line_reserve(size_t need) {
+    if (need > line_cap) {
+        line_cap = need < 512 ? 512 : need * 2;
+        free(line_buf);
+        line_buf = counted_realloc(NULL, line_cap);
+    }
+    return line_buf;
+}
+
+// ---------- Timestamp formatting ----------
+// localtime_r() + strftime() per entry is replaced by two per-thread
+// direct-mapped caches. The zone offset is looked up once per quarter
+// hour (every UTC offset, and so every transition, falls on one); the
+// civil date is then plain integer arithmetic. The formatted text is
+// kept per minute, so entries sharing a minute cost one memcpy. As in
+// GNU ls, files older than six months or in the future show the year.
+enum time_style { TIME_LOCALE, TIME_LONG_ISO, TIME_FULL_ISO, TIME_ISO };
+
+#define SIX_MONTHS (31556952 / 2)   // half a Gregorian year, in seconds
+#define TIME_TEXT_MAX 40
+#define MINUTE_SLOTS 256
+#define ZONE_SLOTS 64
+
+static const char month_names[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+struct minute_slot {
+    int used;
+    enum time_style style;
+    long long minute;               // floor(t / 60)
+    long gmtoff;
+    unsigned char len[2];           // [0] recent, [1] old or future
+    char text[2][TIME_TEXT_MAX];
+};
+
+struct zone_slot {
+    int used;
+    long long quarter;              // floor(t / 900)
+    long gmtoff;
+};
+
+static enum time_style time_style = TIME_LOCALE;
+static time_t time_now;             // taken once per run, and per --watch redraw
+static __thread struct minute_slot minute_cache[MINUTE_SLOTS];
+static __thread struct zone_slot zone_cache[ZONE_SLOTS];
+static pthread_once_t tz_once = PTHREAD_ONCE_INIT;
+static long stat_time_hits = 0, stat_time_misses = 0, stat_tz_calls = 0;
+
+static long long floor_div(long long a, long long b) {
+    return a / b - (a % b < 0);
+}
+
+// Days since 1970-01-01 to a proleptic Gregorian date (H. Hinnant).
+static void civil_from_days(long long z, long long *y, int *m, int *d) {
+    z += 719468;
+    long long era = floor_div(z, 146097);
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = (long long)yoe + era * 400 + (*m <= 2);
+}
+
+static long zone_offset(time_t t) {
+    long long quarter = floor_div(t, 900);
+    struct zone_slot *z = &zone_cache[(unsigned long long)quarter % ZONE_SLOTS];
+    if (!z->used || z->quarter != quarter) {
+        struct tm tm;
+        pthread_once(&tz_once, tzset);
+        z->gmtoff = localtime_r(&t, &tm) ? tm.tm_gmtoff : 0;
+        z->quarter = quarter;
+        z->used = 1;
+        STAT_ADD(stat_tz_calls, 1);
+    }
+    return z->gmtoff;
+}
+
+// Re-reads TZ and forgets the calling thread's cached offsets and text.
+// Worker threads start with empty caches, so only the caller needs this.
+static void reload_time_zone(void) {
+    pthread_once(&tz_once, tzset);
+    tzset();
+    memset(minute_cache, 0, sizeof(minute_cache));
+    memset(zone_cache, 0, sizeof(zone_cache));
+}
+
+static const struct minute_slot *minute_lookup(time_t t) {
+    long long minute = floor_div(t, 60);
+    struct minute_slot *s = &minute_cache[(unsigned long long)minute % MINUTE_SLOTS];
+    if (s->used && s->minute == minute && s->style == time_style) {
+        STAT_ADD(stat_time_hits, 1);
+        return s;
+    }
+    STAT_ADD(stat_time_misses, 1);
+
+    long gmtoff = zone_offset(t);
+    long long local = minute * 60 + gmtoff;
+    long long days = floor_div(local, 86400);
+    int secs = (int)(local - days * 86400);
+    int hh = secs / 3600, mm = secs / 60 % 60, mon, day;
+    long long year;
+    civil_from_days(days, &year, &mon, &day);
+    const char *b = month_names[mon - 1];
+
+    int r, o;   // lengths of the recent and old forms
+    switch (time_style) {
+        case TIME_LONG_ISO:
+            r = o = snprintf(s->text[0], TIME_TEXT_MAX, "%04lld-%02d-%02d %02d:%02d",
+                             year, mon, day, hh, mm);
+            memcpy(s->text[1], s->text[0], (size_t)r + 1);
+            break;
+        case TIME_FULL_ISO:
+            // Seconds, nanoseconds and zone are appended per entry.
+            r = o = snprintf(s->text[0], TIME_TEXT_MAX, "%04lld-%02d-%02d %02d:%02d:",
+                             year, mon, day, hh, mm);
+            memcpy(s->text[1], s->text[0], (size_t)r + 1);
+            break;
+        case TIME_ISO:
+            r = snprintf(s->text[0], TIME_TEXT_MAX, "%02d-%02d %02d:%02d", mon, day, hh, mm);
+            o = snprintf(s->text[1], TIME_TEXT_MAX, "%04lld-%02d-%02d ", year, mon, day);
+            break;
+        default:
+            r = snprintf(s->text[0], TIME_TEXT_MAX, "%s %02d %02d:%02d", b, day, hh, mm);
+            o = snprintf(s->text[1], TIME_TEXT_MAX, "%s %02d  %lld", b, day, year);
+            break;
+    }
+    s->len[0] = (unsigned char)(r < TIME_TEXT_MAX ? r : TIME_TEXT_MAX - 1);
+    s->len[1] = (unsigned char)(o < TIME_TEXT_MAX ? o : TIME_TEXT_MAX - 1);
+    s->gmtoff = gmtoff;
+    s->minute = minute;
+    s->style = time_style;
+    s->used = 1;
+    return s;
+}
+
+static char *put_2digits(char *p, unsigned v) {
+    memcpy(p, &digit_pairs[v * 2], 2);
+    return p + 2;
+}
+
+// Appends the modification time of 'st' in the current --time-style.
+// At most TIME_TEXT_MAX characters.
+static char *put_time(char *p, const struct stat *st) {
+    time_t t = st->st_mtime;
+    const struct minute_slot *s = minute_lookup(t);
+    int old = t <= time_now - SIX_MONTHS || t > time_now;
+    memcpy(p, s->text[old], s->len[old]);
+    p += s->len[old];
+    if (time_style == TIME_FULL_ISO) {
+        unsigned long ns = (unsigned long)st->st_mtim.tv_nsec;
+        p = put_2digits(p, (unsigned)(t - s->minute * 60));
+        *p++ = '.';
+        p = put_2digits(p, (unsigned)(ns / 10000000));
+        p = put_2digits(p, (unsigned)(ns / 100000 % 100));
+        p = put_2digits(p, (unsigned)(ns / 1000 % 100));
+        p = put_2digits(p, (unsigned)(ns / 10 % 100));
+        *p++ = (char)('0' + ns % 10);
+        long off = s->gmtoff;
+        *p++ = ' ';
+        *p++ = off < 0 ? '-' : '+';
+        if (off < 0) off = -off;
+        p = put_2digits(p, (unsigned)(off / 3600 % 100));
+        p = put_2digits(p, (unsigned)(off / 60 % 60));
+    }
+    return p;
+}
+
+// ---------- Entry terminator (-0 / --zero) ----------
+// With --zero every name, or -l line, ends in NUL instead of a newline,
+// so any byte a name can hold survives `xargs -0`. Names go out as they
+// are, with no color and no directory headers; under -R each one carries
+// its directory so every record is a usable path.
+static int flag_zero = 0;
+static int zero_paths = 0;      // --zero with -R
+static char line_end = '\n';
+
+// ---------- Colored names ----------
+// Writes entry i preceded by its color sequence and followed by the
+// reset, or bare if it has no color.
+static void out_name(const char *path, struct entry_table *t, int i) {
+    const struct color_seq *c = get_color(path, t, i);
+    const char *name = table_name(t, i);
+    size_t len = t->name_len[i];
+    if (c) out_write(out, c->seq, c->len);
+    if (quoting_active) {
+        char *start = out_reserve(out, QUOTED_MAX(len));
+        out->len += (size_t)(put_quoted(start, name, len, t->dirty[i]) - start);
+    } else {
+        out_write(out, name, len);
+    }
+    if (c) out_write(out, color_reset.seq, color_reset.len);
+}
+
+// ---------- Long Listing (-l) ----------
+// Two phases over the directory: the first fetches each entry's stat
+// data and owner names into a row and tracks the widest link count,
+// owner, group and size; the second renders every line with exactly
+// that padding. Entries are stat'ed once, in the first phase.
+struct long_row {
+    const struct stat *st;      // NULL if lstat failed
+    const char *user, *group;
+    int user_len, group_len;
+    char ids[2][24];            // -n: uid and gid as text
+};
+
+static __thread struct long_row *long_rows = NULL;
+static __thread size_t long_rows_cap = 0;
+
+static int uint_width(unsigned long long v) {
+    int w = 1;
+    while (v >= 10) {
+        v /= 10;
+        w++;
+    }
+    return w;
+}
+
+void print_long_listing(const char *path, struct entry_table *t) {
+    size_t path_len = strlen(path);
+    int n = t->n;
+    pthread_once(&perm_table_once, init_perm_table);
+    if ((size_t)n > long_rows_cap) {
+        free(long_rows);
+        long_rows_cap = (size_t)n;
+        long_rows = counted_realloc(NULL, sizeof(*long_rows) * long_rows_cap);
+    }
+
+    int w_nlink = 1, w_user = 1, w_group = 1, w_size = 1;
+    for (int i = 0; i < n; i++) {
+        struct long_row *r = &long_rows[i];
+        const struct stat *st = r->st = entry_stat(path, t, i);
+        if (!st) {
+            perror(table_name(t, i));
+            continue;
+        }
+        if (flag_numeric) {
+            *put_uint(r->ids[0], (unsigned long long)st->st_uid, 0) = '\0';
+            *put_uint(r->ids[1], (unsigned long long)st->st_gid, 0) = '\0';
+            r->user = r->ids[0];
+            r->group = r->ids[1];
+        } else {
+            r->user = uid_to_name(st->st_uid);
+            r->group = gid_to_name(st->st_gid);
+        }
+        r->user_len = (int)strlen(r->user);
+        r->group_len = (int)strlen(r->group);
+        int w = uint_width((unsigned long long)st->st_nlink);
+        if (w > w_nlink) w_nlink = w;
+        if (r->user_len > w_user) w_user = r->user_len;
+        if (r->group_len > w_group) w_group = r->group_len;
+        w = uint_width((unsigned long long)st->st_size);
+        if (w > w_size) w_size = w;
+    }
+
+    for (int i = 0; i < n && !output_closed; i++) {
+        const struct long_row *r = &long_rows[i];
+        const struct stat *st = r->st;
+        if (!st) continue;
+        const struct color_seq *color = get_color(path, t, i);
+
+        // --zero -R names carry their directory, as in the plain listing.
+        size_t prefix = zero_paths && !memchr(table_name(t, i), '/', t->name_len[i])
+                        ? path_len + 1 : 0;
+        // mode(10) + separators + padded fields + time + name + colors
+        size_t need = 16 + w_nlink + w_user + w_group + w_size + TIME_TEXT_MAX +
+                      prefix + QUOTED_MAX(t->name_len[i]) +
+                      (color ? color->len + color_reset.len : 0);
+        char *line = line_reserve(need), *p = line;
+
+        *p++ = S_ISDIR(st->st_mode) ? 'd' : '-';
+        memcpy(p, perm_table[st->st_mode & 0777], 9);
+        p += 9;
+        *p++ = ' ';
+        p = put_uint(p, (unsigned long long)st->st_nlink, w_nlink);
+        *p++ = ' ';
+        memcpy(p, r->user, (size_t)r->user_len);
+        memset(p + r->user_len, ' ', (size_t)(w_user - r->user_len));
+        p += w_user;
+        *p++ = ' ';
+        memcpy(p, r->group, (size_t)r->group_len);
+        memset(p + r->group_len, ' ', (size_t)(w_group - r->group_len));
+        p += w_group;
+        *p++ = ' ';
+        p = put_uint(p, (unsigned long long)st->st_size, w_size);
+        *p++ = ' ';
+        p = put_time(p, st);
+        *p++ = ' ';
+        if (color) {
+            memcpy(p, color->seq, color->len);
+            p += color->len;
+        }
+        if (prefix) {
+            memcpy(p, path, path_len);
+            p[path_len] = '/';
+            p += prefix;
+        }
+        p = put_quoted(p, table_name(t, i), t->name_len[i], t->dirty[i]);
+        if (color) {
+            memcpy(p, color_reset.seq, color_reset.len);
+            p += color_reset.len;
+        }
+        *p++ = line_end;
+
+        out_write(out, line, (size_t)(p - line));
+        STAT_ADD(stat_long_entries, 1);
+    }
+}
+
+// ---------- Column layout engine (-C and -x) ----------
+// Every column gets its own width instead of all columns taking the
+// widest name. One pass over the names evaluates every candidate column
+// count at once (as GNU ls does): for each count it tracks the widths of
+// its columns and the resulting line length, and drops the count as soon
+// as a line no longer fits. The most columns that still fit wins. Cost is
+// O(n * max_cols), where max_cols <= term_width / MIN_COLUMN_WIDTH.
+struct column_layout {
+    int cols, rows;
+    int *widths;        // per column, padding included (last one unpadded)
+};
+
+struct column_config {
+    int valid;
+    int line_len;
+    int *widths;
+};
+
+// 'by_rows' selects -x order (row-major) instead of -C (column-major).
+// The candidate widths and the result are taken from 'a'.
+static void compute_layout(const int *lens, int n, int term_width, int by_rows,
+                           struct arena *a, struct column_layout *lay) {
+    int max_cols = term_width / MIN_COLUMN_WIDTH;
+    if (max_cols < 1) max_cols = 1;
+    if (max_cols > n) max_cols = n;
+
+    struct column_config *cfg = arena_alloc(a, sizeof(*cfg) * max_cols);
+    int *pool = arena_alloc(a, sizeof(*pool) * ((size_t)max_cols * (max_cols + 1) / 2));
+    for (int c = 0, off = 0; c < max_cols; off += ++c) {
+        cfg[c].valid = 1;
+        cfg[c].line_len = (c + 1) * MIN_COLUMN_WIDTH;
+        cfg[c].widths = pool + off;
+        for (int k = 0; k <= c; k++) cfg[c].widths[k] = MIN_COLUMN_WIDTH;
+    }
+
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < max_cols; c++) {
+            if (!cfg[c].valid) continue;
+            int cols = c + 1;
+            int rows = (n + cols - 1) / cols;
+            int idx = by_rows ? i % cols : i / rows;
+            int len = lens[i] + (idx == cols - 1 ? 0 : COL_PADDING);
+            if (cfg[c].widths[idx] < len) {
+                cfg[c].line_len += len - cfg[c].widths[idx];
+                cfg[c].widths[idx] = len;
+                cfg[c].valid = cfg[c].line_len < term_width;
+            }
+        }
+    }
+
+    int best = max_cols - 1;
+    while (best > 0 && !cfg[best].valid) best--;
+    lay->cols = best + 1;
+    lay->rows = (n + lay->cols - 1) / lay->cols;
+    lay->widths = cfg[best].widths;
+}
+
+// The layout reads nothing but the width column; its scratch lives in
+// the thread's arena until the directory is printed.
+static void print_columns(const char *path, struct entry_table *t, int by_rows) {
+    int n = t->n;
+    if (n == 0) return;
+    const int *lens = t->width;
+
+    struct arena_mark mark = arena_mark(&walk_arena);
+    struct column_layout lay;
+    compute_layout(lens, n, get_terminal_width(), by_rows, &walk_arena, &lay);
+
+    for (int r = 0; r < lay.rows && !output_closed; r++) {
+        for (int c = 0; c < lay.cols; c++) {
+            int idx = by_rows ? r * lay.cols + c : r + c * lay.rows;
+            if (idx >= n) break;
+            out_name(path, t, idx);
+
+            // Pad only if another name follows on this line.
+            int next = by_rows ? idx + 1 : idx + lay.rows;
+            if (c < lay.cols - 1 && next < n)
+                for (int pad = lens[idx]; pad < lay.widths[c]; pad++)
+                    out_putc(out, ' ');
+        }
+        out_putc(out, '\n');
+    }
+    arena_release(&walk_arena, mark);
+}
+
+// ---------- Column Display (-C) ----------
+void print_down_then_across(const char *path, struct entry_table *t) {
+    print_columns(path, t, 0);
+}
+
+// ---------- Horizontal Display (-x) ----------
+void print_horizontal_across(const char *path, struct entry_table *t) {
+    print_columns(path, t, 1);
+}
+
+// ---------- JSON output (--format=json / --format=ndjson) ----------
+// One object per entry, built in place in the output buffer:
+//   {"path":..,"name":..,"type":..,"mode":..,"nlink":..,"uid":..,"gid":..,
+//    "size":..,"blocks":..,"atime":..,"mtime":..,"ctime":..}
+// mode is the permission bits (st_mode & 07777) as a number; times are
+// seconds since the epoch with nanoseconds. Strings escape '"', '\' and
+// control characters and copy valid UTF-8 as it is. A byte that is not
+// part of a valid UTF-8 sequence becomes U+FFFD, and the object then also
+// carries "path_bytes" and/or "name_bytes": the exact bytes of that string
+// in lowercase hex, so no name is lost. ndjson writes
+// one object per line and flushes stdout after every directory, so a
+// consumer of -R output can start before the walk ends. json wraps the
+// same objects in a single array.
+enum out_format { FMT_TEXT, FMT_JSON, FMT_NDJSON, FMT_BINARY, FMT_COLUMNAR };
+
+static enum out_format out_format = FMT_TEXT;
+static int json_started = 0;    // an array element has been written
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#define PUT_LIT(p, lit) (memcpy((p), (lit), sizeof(lit) - 1), (p) + sizeof(lit) - 1)
+
+// Length of the valid UTF-8 sequence at 's' (2-4 bytes), or 0 if the
+// bytes there are not one: overlong forms, surrogates and code points
+// past U+10FFFF are all rejected.
+static int utf8_seq_len(const unsigned char *s, size_t len) {
+    int n;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) n = 2;
+    else if (s[0] >= 0xe0 && s[0] <= 0xef) n = 3;
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4) n = 4;
+    else return 0;
+    if ((size_t)n > len) return 0;
+    for (int k = 1; k < n; k++)
+        if ((s[k] & 0xc0) != 0x80) return 0;
+    if (s[0] == 0xe0 && s[1] < 0xa0) return 0;
+    if (s[0] == 0xed && s[1] >= 0xa0) return 0;
+    if (s[0] == 0xf0 && s[1] < 0x90) return 0;
+    if (s[0] == 0xf4 && s[1] >= 0x90) return 0;
+    return n;
+}
+
+// Escapes 's' without the surrounding quotes. Sets *bad when a byte had
+// to be replaced with U+FFFD.
+static char *put_json_chars(char *p, const char *s, size_t len, int *bad) {
+    const unsigned char *u = (const unsigned char *)s;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = u[i];
+        if (c >= 0x80) {
+            int n = utf8_seq_len(u + i, len - i);
+            if (n) {
+                memcpy(p, u + i, (size_t)n);
+                p += n;
+                i += (size_t)n - 1;
+            } else {
+                p = PUT_LIT(p, "\\ufffd");
+                *bad = 1;
+            }
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            *p++ = (char)c;
+            continue;
+        }
+        *p++ = '\\';
+        switch (c) {
+            case '"':  *p++ = '"'; break;
+            case '\\': *p++ = '\\'; break;
+            case '\n': *p++ = 'n'; break;
+            case '\t': *p++ = 't'; break;
+            case '\r': *p++ = 'r'; break;
+            default:
+                memcpy(p, "u00", 3);
+                p[3] = hex_digits[c >> 4];
+                p[4] = hex_digits[c & 15];
+                p += 5;
+                break;
+        }
+    }
+    return p;
+}
+
+static char *put_json_string(char *p, const char *s, size_t len, int *bad) {
+    *p++ = '"';
+    p = put_json_chars(p, s, len, bad);
+    *p++ = '"';
+    return p;
+}
+
+// The raw bytes of 's' in lowercase hex, without quotes.
+static char *put_json_hex(char *p, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        *p++ = hex_digits[c >> 4];
+        *p++ = hex_digits[c & 15];
+    }
+    return p;
+}
+
+static char *put_json_time(char *p, struct timespec ts) {
+    if (ts.tv_sec < 0 && ts.tv_nsec) {  // -1.5 s is stored as -2 s + 0.5e9 ns
+        ts.tv_sec++;
+        ts.tv_nsec = 1000000000L - ts.tv_nsec;
+        *p++ = '-';
+    }
+    if (ts.tv_sec < 0) {
+        *p++ = '-';
+        ts.tv_sec = -ts.tv_sec;
+    }
+    p = put_uint(p, (unsigned long long)ts.tv_sec, 0);
+    *p++ = '.';
+    unsigned long ns = (unsigned long)ts.tv_nsec;
+    for (int d = 8; d >= 0; d--) {
+        p[d] = (char)('0' + ns % 10);
+        ns /= 10;
+    }
+    return p + 9;
+}
+
+static const char *json_type(mode_t m) {
+    if (S_ISREG(m))  return "\"file\"";
+    if (S_ISDIR(m))  return "\"directory\"";
+    if (S_ISLNK(m))  return "\"symlink\"";
+    if (S_ISFIFO(m)) return "\"fifo\"";
+    if (S_ISSOCK(m)) return "\"socket\"";
+    if (S_ISBLK(m))  return "\"block\"";
+    if (S_ISCHR(m))  return "\"char\"";
+    return "\"unknown\"";
+}
+
+void print_json(const char *path, struct entry_table *t) {
+    size_t path_len = strlen(path);
+    for (int i = 0; i < t->n && !output_closed; i++) {
+        const struct stat *st = entry_stat(path, t, i);
+        const char *name = table_name(t, i);
+        size_t name_len = t->name_len[i];
+        if (!st) {
+            perror(name);
+            continue;
+        }
+        // A non-directory operand is listed under "." with the operand
+        // as its name; if that holds a '/', it is the path already.
+        int own_path = memchr(name, '/', name_len) != NULL;
+
+        // Escaped strings grow at most sixfold and hex copies double;
+        // numbers and field names fit in 288 bytes.
+        size_t need = 288 + 8 * (path_len + 2 * name_len);
+        char *start = out_reserve(out, need), *p = start;
+        int bad_path = 0, bad_name = 0;
+
+        if (out_format == FMT_JSON) {
+            p = json_started ? PUT_LIT(p, ",\n") : PUT_LIT(p, "\n");
+            json_started = 1;
+        }
+        p = PUT_LIT(p, "{\"path\":");
+        if (own_path) {
+            p = put_json_string(p, name, name_len, &bad_path);
+        } else {
+            *p++ = '"';
+            p = put_json_chars(p, path, path_len, &bad_path);
+            *p++ = '/';
+            p = put_json_chars(p, name, name_len, &bad_path);
+            *p++ = '"';
+        }
+        p = PUT_LIT(p, ",\"name\":");
+        p = put_json_string(p, name, name_len, &bad_name);
+        if (bad_path) {
+            p = PUT_LIT(p, ",\"path_bytes\":\"");
+            if (!own_path) {
+                p = put_json_hex(p, path, path_len);
+                p = put_json_hex(p, "/", 1);
+            }
+            p = put_json_hex(p, name, name_len);
+            *p++ = '"';
+        }
+        if (bad_name) {
+            p = PUT_LIT(p, ",\"name_bytes\":\"");
+            p = put_json_hex(p, name, name_len);
+            *p++ = '"';
+        }
+        p = PUT_LIT(p, ",\"type\":");
+        const char *type = json_type(st->st_mode);
+        size_t type_len = strlen(type);
+        memcpy(p, type, type_len);
+        p += type_len;
+        p = PUT_LIT(p, ",\"mode\":");
+        p = put_uint(p, (unsigned long long)(st->st_mode & 07777), 0);
+        p = PUT_LIT(p, ",\"nlink\":");
+        p = put_uint(p, (unsigned long long)st->st_nlink, 0);
+        p = PUT_LIT(p, ",\"uid\":");
+        p = put_uint(p, (unsigned long long)st->st_uid, 0);
+        p = PUT_LIT(p, ",\"gid\":");
+        p = put_uint(p, (unsigned long long)st->st_gid, 0);
+        p = PUT_LIT(p, ",\"size\":");
+        p = put_uint(p, (unsigned long long)st->st_size, 0);
+        p = PUT_LIT(p, ",\"blocks\":");
+        p = put_uint(p, (unsigned long long)st->st_blocks, 0);
+        p = PUT_LIT(p, ",\"atime\":");
+        p = put_json_time(p, st->st_atim);
+        p = PUT_LIT(p, ",\"mtime\":");
+        p = put_json_time(p, st->st_mtim);
+        p = PUT_LIT(p, ",\"ctime\":");
+        p = put_json_time(p, st->st_ctim);
+        *p++ = '}';
+        if (out_format == FMT_NDJSON) *p++ = '\n';
+        out->len += (size_t)(p - start);
+    }
+}
+
+// ---------- Binary output (--format=binary) ----------
+// Records as laid out in lsbin.h: each one is filled straight from the
+// cached stat data in the output buffer, name and padding appended, with
+// no text conversion at all. lsbin-read decodes the stream.
+static void put_lsbin_record(uint32_t kind, const char *name, size_t len,
+                             const struct stat *st) {
+    size_t total = LSBIN_ALIGN(sizeof(struct lsbin_record) + len);
+    char *start = out_reserve(out, total);
+    struct lsbin_record *r = (struct lsbin_record *)start;
+    memset(r, 0, sizeof(*r));
+    r->kind = kind;
+    r->name_len = (uint32_t)len;
+    if (st) {
+        r->mode = st->st_mode;
+        r->nlink = (uint32_t)st->st_nlink;
+        r->uid = st->st_uid;
+        r->gid = st->st_gid;
+        r->dev_major = major(st->st_dev);
+        r->dev_minor = minor(st->st_dev);
+        r->rdev_major = major(st->st_rdev);
+        r->rdev_minor = minor(st->st_rdev);
+        r->ino = st->st_ino;
+        r->size = (uint64_t)st->st_size;
+        r->blocks = (uint64_t)st->st_blocks;
+        r->atime_sec = st->st_atim.tv_sec;
+        r->mtime_sec = st->st_mtim.tv_sec;
+        r->ctime_sec = st->st_ctim.tv_sec;
+        r->atime_nsec = (uint32_t)st->st_atim.tv_nsec;
+        r->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+        r->ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+        r->blksize = (uint32_t)st->st_blksize;
+    }
+    memcpy(start + sizeof(*r), name, len);
+    memset(start + sizeof(*r) + len, 0, total - sizeof(*r) - len);
+    out->len += total;
+}
+
+static void put_lsbin_header(void) {
+    struct lsbin_header h = { LSBIN_MAGIC, LSBIN_VERSION, sizeof(struct lsbin_header),
+                              sizeof(struct lsbin_record), LSBIN_BYTE_ORDER };
+    out_write(out, (const char *)&h, sizeof(h));
+}
+
+void print_binary(const char *path, struct entry_table *t) {
+    put_lsbin_record(LSBIN_DIR, path, strlen(path), NULL);
+    for (int i = 0; i < t->n && !output_closed; i++) {
+        const struct stat *st = entry_stat(path, t, i);
+        if (!st) {
+            perror(table_name(t, i));
+            continue;
+        }
+        put_lsbin_record(LSBIN_ENTRY, table_name(t, i), t->name_len[i], st);
+    }
+}
+
+// ---------- Columnar export (--format=columnar) ----------
+// Row groups as laid out in lsbin.h. The entries of a directory are
+// stat'ed once (their cached records are reused), then every group of up
+// to --row-group rows is written column by column into space reserved in
+// the output buffer.
+static int opt_row_group = 0;           // 0: one group per directory
+static __thread int *col_rows = NULL;   // entries with stat data
+static __thread size_t col_rows_cap = 0;
+
+static void put_lscol_header(void) {
+    struct lscol_header h = { LSCOL_MAGIC, LSCOL_VERSION, sizeof(struct lscol_header),
+                              sizeof(struct lscol_group), LSBIN_BYTE_ORDER };
+    out_write(out, (const char *)&h, sizeof(h));
+}
+
+static void put_lscol_group(const char *path, const struct entry_table *t,
+                            const int *rows, int n) {
+    static const size_t elem[LSCOL_COLUMNS] = {
+        sizeof(uint32_t), 1, sizeof(uint32_t), sizeof(uint64_t),
+        sizeof(int64_t), sizeof(uint32_t), sizeof(uint32_t)
+    };
+    struct lscol_group g;
+    memset(&g, 0, sizeof(g));
+    size_t path_len = strlen(path), names_len = 0;
+    for (int i = 0; i < n; i++) names_len += t->name_len[rows[i]];
+
+    g.rows = (uint32_t)n;
+    g.path_len = (uint32_t)path_len;
+    uint64_t pos = LSBIN_ALIGN(sizeof(g) + path_len);
+    for (int c = 0; c < LSCOL_COLUMNS; c++) {
+        g.column_offset[c] = pos;
+        g.column_size[c] = c == LSCOL_NAMES ? names_len :
+                           elem[c] * (size_t)(c == LSCOL_NAME_OFFSETS ? n + 1 : n);
+        pos = LSBIN_ALIGN(pos + g.column_size[c]);
+    }
+    g.group_size = pos;
+
+    char *base = out_reserve(out, (size_t)pos);
+    memset(base, 0, (size_t)pos);
+    memcpy(base, &g, sizeof(g));
+    memcpy(base + sizeof(g), path, path_len);
+
+    uint32_t *offsets = (uint32_t *)(base + g.column_offset[LSCOL_NAME_OFFSETS]);
+    char *names = base + g.column_offset[LSCOL_NAMES];
+    uint32_t *modes = (uint32_t *)(base + g.column_offset[LSCOL_MODES]);
+    uint64_t *sizes = (uint64_t *)(base + g.column_offset[LSCOL_SIZES]);
+    int64_t *mtimes = (int64_t *)(base + g.column_offset[LSCOL_MTIMES]);
+    uint32_t *uids = (uint32_t *)(base + g.column_offset[LSCOL_UIDS]);
+    uint32_t *gids = (uint32_t *)(base + g.column_offset[LSCOL_GIDS]);
+    uint32_t off = 0;
+    for (int i = 0; i < n; i++) {
+        offsets[i] = off;
+        memcpy(names + off, table_name(t, rows[i]), t->name_len[rows[i]]);
+        off += t->name_len[rows[i]];
+    }
+    offsets[n] = off;
+    // Modes, sizes and mtimes come straight from the table's columns.
+    for (int i = 0; i < n; i++) modes[i] = t->mode[rows[i]];
+    for (int i = 0; i < n; i++) sizes[i] = (uint64_t)t->size[rows[i]];
+    for (int i = 0; i < n; i++) mtimes[i] = t->mtime[rows[i]];
+    for (int i = 0; i < n; i++) uids[i] = t->ents[rows[i]].st.st_uid;
+    for (int i = 0; i < n; i++) gids[i] = t->ents[rows[i]].st.st_gid;
+    out->len += (size_t)pos;
+}
+
+void print_columnar(const char *path, struct entry_table *t) {
+    int n = t->n;
+    if ((size_t)n > col_rows_cap) {
+        free(col_rows);
+        col_rows_cap = (size_t)n;
+        col_rows = counted_realloc(NULL, sizeof(*col_rows) * col_rows_cap);
+    }
+    int rows = 0;
+    for (int i = 0; i < n; i++) {
+        if (entry_stat(path, t, i)) col_rows[rows++] = i;
+        else perror(table_name(t, i));
+    }
+    int block = opt_row_group > 0 ? opt_row_group : rows;
+    for (int i = 0; i < rows && !output_closed; i += block)
+        put_lscol_group(path, t, col_rows + i, rows - i < block ? rows - i : block);
+}
+
+// ---------- Print one directory's entries ----------
+void print_entries(const char *path, struct entry_table *t,
+                   int flag_l, int flag_C, int flag_x) {
+    if (out_format == FMT_BINARY)
+        print_binary(path, t);
+    else if (out_format == FMT_COLUMNAR)
+        print_columnar(path, t);
+    else if (out_format != FMT_TEXT)
+        print_json(path, t);
+    else if (flag_l)
+        print_long_listing(path, t);
+    else if (flag_x)
+        print_horizontal_across(path, t);
+    else if (flag_C)
+        print_down_then_across(path, t);
+    else
+        for (int i = 0; i < t->n && !output_closed; i++) {
+            if (zero_paths && !memchr(table_name(t, i), '/', t->name_len[i])) {
+                out_puts(out, path);
+                out_putc(out, '/');
+            }
+            out_name(path, t, i);
+            out_putc(out, line_end);
+        }
+}
+
+// ---------- Subtree size totals (--total-size) ----------
+// Each directory's header carries the st_blocks and st_size of everything
+// listed below it. The sums are built bottom-up by do_ls() during the
+// same walk; to print them in the header, a directory's subdirectory
+// output is written to a memory stream first and emitted after the
+// directory's own listing. A file with several hard links is counted
+// once, through a set of (st_dev, st_ino).
+struct tree_total {
+    long long blocks;   // 512-byte units, as in st_blocks
+    long long bytes;
+};
+
+static int flag_total_size = 0;
+
+struct inode_key { dev_t dev; ino_t ino; };
+static struct inode_key *seen_inodes = NULL;   // open addressing, ino 0 = free
+static size_t seen_cap = 0, seen_used = 0;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns 1 the first time (dev, ino) is offered, 0 afterwards.
+// Caller holds seen_lock.
+static int inode_first_seen(dev_t dev, ino_t ino) {
+    if ((seen_used + 1) * 2 > seen_cap) {
+        size_t old_cap = seen_cap;
+        struct inode_key *old = seen_inodes;
+        seen_cap = old_cap ? old_cap * 2 : 1024;
+        seen_inodes = counted_realloc(NULL, sizeof(*seen_inodes) * seen_cap);
+        memset(seen_inodes, 0, sizeof(*seen_inodes) * seen_cap);
+        seen_used = 0;
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].ino) inode_first_seen(old[i].dev, old[i].ino);
+        free(old);
+    }
+    size_t h = (size_t)((ino * 0x9E3779B97F4A7C15ull) ^ dev) & (seen_cap - 1);
+    while (seen_inodes[h].ino) {
+        if (seen_inodes[h].ino == ino && seen_inodes[h].dev == dev) return 0;
+        h = (h + 1) & (seen_cap - 1);
+    }
+    seen_inodes[h].dev = dev;
+    seen_inodes[h].ino = ino;
+    seen_used++;
+    return 1;
+}
+
+static void reset_seen_inodes(void) {
+    free(seen_inodes);
+    seen_inodes = NULL;
+    seen_cap = seen_used = 0;
+}
+
+static void add_entry_size(const char *path, struct entry_table *t, int i,
+                           struct tree_total *sum) {
+    const struct stat *st = entry_stat(path, t, i);
+    if (!st) return;
+    if (st->st_nlink > 1 && !S_ISDIR(st->st_mode)) {
+        pthread_mutex_lock(&seen_lock);
+        int first = inode_first_seen(st->st_dev, st->st_ino);
+        pthread_mutex_unlock(&seen_lock);
+        if (!first) return;
+    }
+    sum->blocks += st->st_blocks;
+    sum->bytes += st->st_size;
+}
+
+// ---------- Unsorted streaming (-U) ----------
+// With -U and one name per line, names are written as readdir returns
+// them: output starts at once and memory stays flat however large the
+// directory is. Only the names of subdirectories are kept, for -R.
+// 'operand' is set for a directory named on the command line, whose
+// header is printed even when it turns out to be empty.
+static void stream_dir(const char *path, int flag_R, int operand) {
+    if (output_closed) return;
+    int gi_pushed = flag_gitignore && gitignore_push(path);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        if (gi_pushed) gitignore_pop();
+        return;
+    }
+
+    size_t path_len = strlen(path);
+    struct arena_mark mark = arena_mark(&walk_arena);
+    STAT_ADD(stat_arena_dirs, 1);
+    char **subdirs = NULL;
+    int nsub = 0, sub_cap = 0, listed = 0;
+    char full[1024];
+    struct dirent *entry;
+    while (!output_closed && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        if (entry_filtered(path, entry->d_name, entry->d_type)) continue;
+        if (!listed++ && !flag_zero) out_printf(out, "\n%s:\n", path);
+
+        mode_t mode = 0;   // known only if coloring stat'ed the entry
+        if (use_color || quoting_active) {
+            struct arena_mark row = arena_mark(&walk_arena);
+            struct entry_table one;
+            table_init(&one, &walk_arena);
+            table_add(&one, entry->d_name, strlen(entry->d_name), entry->d_type, 1);
+            out_name(path, &one, 0);
+            mode = one.mode[0];
+            arena_release(&walk_arena, row);
+        } else {
+            if (zero_paths) {
+                out_write(out, path, path_len);
+                out_putc(out, '/');
+            }
+            out_puts(out, entry->d_name);
+        }
+        out_putc(out, line_end);
+
+        if (!flag_R) continue;
+        snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (!mode && lstat(full, &st) == 0) mode = st.st_mode;
+            is_dir = S_ISDIR(mode);
+        }
+        if (!is_dir) continue;
+        if (nsub == sub_cap) {
+            sub_cap = sub_cap ? sub_cap * 2 : 16;
+            char **grown = arena_alloc(&walk_arena, sizeof(*subdirs) * sub_cap);
+            if (nsub) memcpy(grown, subdirs, sizeof(*subdirs) * nsub);
+            subdirs = grown;
+        }
+        subdirs[nsub++] = arena_strndup(&walk_arena, full, strlen(full));
+    }
+    closedir(dir);
+    if (operand && !listed && !flag_zero) out_printf(out, "\n%s:\n", path);
+
+    for (int i = 0; i < nsub; i++)
+        stream_dir(subdirs[i], flag_R, 0);
+    arena_release(&walk_arena, mark);
+    if (gi_pushed) gitignore_pop();
+}
+
+// ---------- Recursive Listing ----------
+// 'sum', if not NULL, receives the size of the subtree (--total-size);
+// it is NULL only for an operand, which gets its header even if empty.
+void do_ls(const char *path, int flag_l, int flag_C, int flag_x, int flag_R,
+           struct tree_total *sum) {
+    struct entry_table t;
+    if (output_closed) return;
+    if (flag_unsorted && out_format == FMT_TEXT && !flag_l && !flag_C && !flag_x &&
+        !flag_total_size && !cache_path) {
+        stream_dir(path, flag_R, !sum);
+        return;
+    }
+    int gi_pushed = flag_gitignore && gitignore_push(path);
+    struct arena_mark mark = arena_mark(&walk_arena);
+    STAT_ADD(stat_arena_dirs, 1);
+    int n = read_filenames(path, &t, &walk_arena);
+    if (n <= 0) {
+        if (!sum && out_format == FMT_TEXT && !flag_zero)
+            out_printf(out, flag_total_size ? "\n%s: total 0 blocks, 0 bytes\n" : "\n%s:\n",
+                       path);
+        arena_release(&walk_arena, mark);
+        if (gi_pushed) gitignore_pop();
+        return;
+    }
+
+    struct tree_total total = {0, 0};
+    if (flag_total_size)
+        for (int i = 0; i < n; i++) add_entry_size(path, &t, i, &total);
+
+    if (out_format == FMT_NDJSON) {
+        print_entries(path, &t, flag_l, flag_C, flag_x);
+        if (out == &stdout_buf) out_flush(out);
+    } else if (out_format != FMT_TEXT) {
+        print_entries(path, &t, flag_l, flag_C, flag_x);
+    } else if (!flag_total_size) {
+        if (!flag_zero) out_printf(out, "\n%s:\n", path);
+        print_entries(path, &t, flag_l, flag_C, flag_x);
+    }
+
+    // Recursive part
+    struct outbuf sub = { -1, NULL, 0, 0, 0 };
+    struct outbuf *parent_out = out;
+    if (flag_R) {
+        if (flag_total_size) out = &sub;
+        char full[1024];
+        for (int i = 0; i < n && !output_closed; i++) {
+            // d_type answers "is it a directory?" without an lstat on
+            // filesystems that fill it in.
+            int is_dir;
+            if (t.ents[i].d_type != DT_UNKNOWN && !t.mode[i]) {
+                is_dir = t.ents[i].d_type == DT_DIR;
+            } else {
+                if (!t.mode[i] && !entry_stat(path, &t, i)) continue;
+                is_dir = S_ISDIR(t.mode[i]);
+            }
+            const char *name = table_name(&t, i);
+            snprintf(full, sizeof(full), "%s/%s", path, name);
+            if (is_dir &&
+                strcmp(name, ".") != 0 &&
+                strcmp(name, "..") != 0) {
+                do_ls(full, flag_l, flag_C, flag_x, flag_R, &total);
+            }
+        }
+    }
+
+    if (flag_total_size) {
+        out = parent_out;
+        // Blocks are shown in 1K units, as du and ls "total" do.
+        out_printf(out, "\n%s: total %lld blocks, %lld bytes\n",
+                path, total.blocks / 2, total.bytes);
+        print_entries(path, &t, flag_l, flag_C, flag_x);
+        out_write(out, sub.data, sub.len);
+        free(sub.data);
+        if (sum) {
+            sum->blocks += total.blocks;
+            sum->bytes += total.bytes;
+        }
+    }
+
+    arena_release(&walk_arena, mark);
+    if (gi_pushed) gitignore_pop();
+}
+
+// ---------- Watch mode (--watch) ----------
+// Lists 'path' once, then keeps the entry table in memory and applies
+// inotify events to it: a created or moved-in name is inserted at its
+// sorted position, a deleted or moved-out name is removed, and a name
+// whose attributes or contents changed only has its cached stat dropped.
+// A redraw therefore re-stats only the entries that changed. If the
+// event queue overflows the directory is read again from scratch.
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE |              \
+                    IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_COALESCE_MS 50
+
+static int flag_watch = 0;
+static long stat_watch_events = 0, stat_watch_redraws = 0;
+
+// Binary search over the sorted table. Returns the index of 'name' or,
+// if absent, -(insertion point) - 1.
+static int find_entry(const struct entry_table *t, const char *name) {
+    int lo = 0, hi = t->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = cmp_names(name, table_name(t, mid));
+        if (c == 0) return mid;
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return -lo - 1;
+}
+
+static void watch_render(const char *path, struct entry_table *t,
+                         int flag_l, int flag_C, int flag_x) {
+    time_now = time(NULL);  // files touched since the last redraw are not "future"
+    if (isatty(STDOUT_FILENO))
+        out_printf(out, "\033[H\033[2J");
+    out_printf(out, "\n%s:\n", path);
+    print_entries(path, t, flag_l, flag_C, flag_x);
+    out_flush(out);
+    STAT_ADD(stat_watch_redraws, 1);
+}
+
+void watch_ls(const char *path, int flag_l, int flag_C, int flag_x) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1 || inotify_add_watch(fd, path, WATCH_MASK) == -1) {
+        perror(path);
+        return;
+    }
+
+    struct entry_table t;
+    int gi_pushed = flag_gitignore && gitignore_push(path);
+    read_filenames(path, &t, NULL);
+    watch_render(path, &t, flag_l, flag_C, flag_x);
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        int changed = 0, rescan = 0, gone = 0;
+
+        // Block for the first batch, then keep draining for a short while
+        // so a burst of events costs one redraw.
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int timeout = -1;
+        while (poll(&pfd, 1, timeout) > 0) {
+            ssize_t len = read(fd, buf, sizeof(buf));
+            if (len <= 0) break;
+            timeout = WATCH_COALESCE_MS;
+
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(*ev) + ev->len;
+                STAT_ADD(stat_watch_events, 1);
+
+                if (ev->mask & IN_Q_OVERFLOW) { rescan = 1; continue; }
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) { gone = 1; continue; }
+                if (ev->len == 0 || ev->name[0] == '.') continue;
+
+                int idx = find_entry(&t, ev->name);
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    if (idx < 0) continue;
+                    table_remove(&t, idx);
+                } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    unsigned char d_type = (ev->mask & IN_ISDIR) ? DT_DIR : DT_UNKNOWN;
+                    if (idx >= 0) {
+                        table_forget_stat(&t, idx);
+                        t.ents[idx].d_type = d_type;
+                    } else {
+                        if (entry_filtered(path, ev->name, d_type)) continue;
+                        table_add(&t, ev->name, strlen(ev->name), d_type, INITIAL_FILES);
+                        table_move_last(&t, -idx - 1);
+                    }
+                } else if (idx >= 0) {
+                    table_forget_stat(&t, idx);
+                }
+                changed = 1;
+            }
+        }
+
+        if (gone || output_closed) break;
+        if (rescan) {
+            table_free(&t);
+            read_filenames(path, &t, NULL);
+            changed = 1;
+        }
+        if (changed)
+            watch_render(path, &t, flag_l, flag_C, flag_x);
+    }
+
+    table_free(&t);
+    if (gi_pushed) gitignore_pop();
+    close(fd);
+}
+
+// ---------- Operands ----------
+// Every operand is listed in command-line order. A directory gets the
+// usual do_ls() treatment; anything else is printed as a single entry.
+// A file that follows a directory's block is set off by a blank line,
+// so it does not read as one of that directory's entries.
+struct listing_flags { int l, C, x, R; };
+
+static int prev_operand_dir = 0;    // the last operand listed was a directory
+
+static void operand_gap(int prev_dir, int is_dir) {
+    if (prev_dir && !is_dir && out_format == FMT_TEXT && !flag_zero) out_putc(out, '\n');
+}
+
+// Lists one operand to 'out'. '*is_dir' says on entry whether the
+// operand before it was a directory and on return whether this one is.
+// Returns 0, or 2 if it could not be accessed.
+static int list_operand(const char *operand, const struct listing_flags *f, int *is_dir) {
+    struct stat st;
+    int dir = stat(operand, &st) == 0 && S_ISDIR(st.st_mode);
+    operand_gap(*is_dir, dir);
+    *is_dir = dir;
+    if (dir) {
+        do_ls(operand, f->l, f->C, f->x, f->R, NULL);
+        return 0;
+    }
+    struct arena_mark mark = arena_mark(&walk_arena);
+    struct entry_table one;
+    table_init(&one, &walk_arena);
+    table_add(&one, operand, strlen(operand), DT_UNKNOWN, 1);
+    int status = 0;
+    if (lstat(operand, &one.ents[0].st) == 0) {
+        one.ents[0].has_stat = 1;
+        table_note_stat(&one, 0);
+        print_entries(".", &one, f->l, f->C, f->x);
+    } else {
+        perror(operand);
+        status = 2;
+    }
+    arena_release(&walk_arena, mark);
+    return status;
+}
+
+// With several operands, the calling thread lists the first one straight
+// to stdout while up to 'jobs' worker threads list the others at once,
+// each into its own memory stream. The calling thread then writes the
+// blocks out strictly in operand order as each one completes, so a slow
+// mount only delays the output that follows it. Once the reader is gone
+// (output_closed) workers stop walking and skip the operands left.
+struct operand_result {
+    struct outbuf buf;
+    int status;
+    int is_dir;
+    int done;
+};
+
+struct operand_queue {
+    char **operands;
+    int count;
+    int next;                       // next operand to claim (atomic)
+    struct listing_flags flags;
+    struct operand_result *results;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+};
+
+static int opt_jobs = 0;            // --jobs; 0 = one per operand, capped
+
+// Frees the calling thread's scratch buffers; workers call it on exit.
+static void free_thread_scratch(void) {
+    arena_destroy(&walk_arena);
+    free(sort_keys);
+    free(sort_tmp);
+    free(sort_scratch);
+    sort_keys = sort_tmp = NULL;
+    sort_scratch = NULL;
+    sort_cap = 0;
+    free(line_buf);
+    line_buf = NULL;
+    line_cap = 0;
+    free(long_rows);
+    long_rows = NULL;
+    long_rows_cap = 0;
+    free(col_rows);
+    col_rows = NULL;
+    col_rows_cap = 0;
+    free(gi_stack);
+    gi_stack = NULL;
+    gi_cap = 0;
+}
+
+static void *operand_worker(void *arg) {
+    struct operand_queue *q = arg;
+    for (;;) {
+        int i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+        if (i >= q->count) break;
+
+        struct operand_result *r = &q->results[i];
+        r->buf.fd = -1;
+        out = &r->buf;
+        int is_dir = 0;
+        int status = output_closed ? 0 : list_operand(q->operands[i], &q->flags, &is_dir);
+
+        pthread_mutex_lock(&q->lock);
+        r->status = status;
+        r->is_dir = is_dir;
+        r->done = 1;
+        pthread_cond_broadcast(&q->done_cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    free_thread_scratch();
+    return NULL;
+}
+
+int list_operands(char **operands, int count, const struct listing_flags *f, int jobs) {
+    if (jobs > count) jobs = count;
+    if (out_format == FMT_JSON) jobs = 1;   // array separators need one writer
+    if (jobs <= 1) {
+        int status = 0;
+        for (int i = 0; i < count && !output_closed; i++) {
+            int st = list_operand(operands[i], f, &prev_operand_dir);
+            if (st > status) status = st;
+        }
+        return status;
+    }
+
+    if (jobs > count - 1) jobs = count - 1;
+    struct operand_queue q = { operands, count, 1, *f, NULL,
+                               PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+    q.results = calloc(count, sizeof(*q.results));
+    pthread_t *threads = malloc(sizeof(*threads) * jobs);
+    if (!q.results || !threads) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < jobs; t++)
+        if (pthread_create(&threads[t], NULL, operand_worker, &q) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+
+    int status = list_operand(operands[0], f, &prev_operand_dir);
+    for (int i = 1; i < count; i++) {
+        struct operand_result *r = &q.results[i];
+        pthread_mutex_lock(&q.lock);
+        while (!r->done) pthread_cond_wait(&q.done_cond, &q.lock);
+        pthread_mutex_unlock(&q.lock);
+        operand_gap(prev_operand_dir, r->is_dir);
+        prev_operand_dir = r->is_dir;
+        out_write(out, r->buf.data, r->buf.len);
+        free(r->buf.data);
+        if (r->status > status) status = r->status;
+    }
+
+    for (int t = 0; t < jobs; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    free(q.results);
+    return status;
+}
+
+// ---------- Batch input (--from-file=FILE) ----------
+// Paths are read from FILE ("-" for stdin) and listed in batches through
+// list_operands(), so one process serves any number of paths with its
+// caches and output stream shared across all of them. The delimiter is
+// NUL if the first block read contains one, newline otherwise; empty
+// records are skipped. Parallelism is opt-in through --jobs.
+#define BATCH_PATHS 4096
+#define BATCH_READ  (64 * 1024)
+
+struct path_reader {
+    int fd;
+    char *buf;          // one spare byte past 'cap' for a final NUL
+    size_t len, cap;    // bytes held / allocated
+    size_t consumed;    // bytes handed out by the previous batch
+    int delim;          // -1 until detected
+    int eof;
+};
+
+static const char *from_file = NULL;
+static long stat_batch_paths = 0;
+
+// Fills 'names' with up to 'max' records, NUL-terminated in place inside
+// r->buf, and returns how many (0 at end of input). The records from the
+// previous call are dropped first, so they must be fully processed.
+static int read_path_batch(struct path_reader *r, char **names, int max) {
+    if (r->consumed) memmove(r->buf, r->buf + r->consumed, r->len - r->consumed);
+    r->len -= r->consumed;
+
+    int n = 0;
+    size_t pos = 0;
+    for (;;) {
+        while (n < max && r->delim >= 0) {
+            char *p = memchr(r->buf + pos, r->delim, r->len - pos);
+            if (!p) break;
+            *p = '\0';
+            if (p > r->buf + pos) names[n++] = r->buf + pos;
+            pos = (size_t)(p - r->buf) + 1;
+        }
+        if (n == max) break;
+        if (r->eof) {
+            if (pos < r->len) {     // last record without a delimiter
+                r->buf[r->len] = '\0';
+                names[n++] = r->buf + pos;
+                pos = r->len;
+            }
+            break;
+        }
+        if (n > 0) break;           // list these before reading more
+
+        // Nothing complete yet: keep the partial record and read on.
+        if (pos) memmove(r->buf, r->buf + pos, r->len - pos);
+        r->len -= pos;
+        pos = 0;
+        if (r->len == r->cap) {
+            r->cap = r->cap ? r->cap * 2 : BATCH_READ;
+            r->buf = counted_realloc(r->buf, r->cap + 1);
+        }
+        ssize_t got = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            if (got < 0) perror(from_file);
+            r->eof = 1;
+            if (r->delim < 0) r->delim = '\n';
+            continue;
+        }
+        if (r->delim < 0)
+            r->delim = memchr(r->buf + r->len, '\0', (size_t)got) ? '\0' : '\n';
+        r->len += (size_t)got;
+    }
+    r->consumed = pos;
+    return n;
+}
+
+int list_from_file(const struct listing_flags *f) {
+    struct path_reader r = { -1, NULL, 0, 0, 0, -1, 0 };
+    r.fd = strcmp(from_file, "-") == 0 ? STDIN_FILENO : open(from_file, O_RDONLY | O_CLOEXEC);
+    if (r.fd == -1) {
+        perror(from_file);
+        return 2;
+    }
+
+    char **names = malloc(sizeof(*names) * BATCH_PATHS);
+    if (!names) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int status = 0, n;
+    while (!output_closed && (n = read_path_batch(&r, names, BATCH_PATHS)) > 0) {
+        int st = list_operands(names, n, f, opt_jobs ? opt_jobs : 1);
+        if (st > status) status = st;
+        STAT_ADD(stat_batch_paths, n);
+    }
+
+    free(names);
+    free(r.buf);
+    if (r.fd != STDIN_FILENO) close(r.fd);
+    return status;
+}
+
+// ---------- Hardware counters (--stats) ----------
+// Cache misses, cache references and instructions for the listing, read
+// through perf_event_open(). The counters are inherited by the worker
+// threads and count user space only, which perf_event_paranoid <= 2
+// allows; where they cannot be opened --stats says so.
+static const uint64_t perf_configs[] = {
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_INSTRUCTIONS
+};
+#define PERF_COUNTERS (sizeof(perf_configs) / sizeof(perf_configs[0]))
+
+static int perf_fds[PERF_COUNTERS] = { -1, -1, -1 };
+static long long perf_values[PERF_COUNTERS];
+static int perf_errno = 0;
+
+static void perf_start(void) {
+    perf_errno = 0;
+    for (size_t i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = perf_configs[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (perf_fds[i] == -1) {
+            perf_errno = errno;
+            break;
+        }
+    }
+    for (size_t i = 0; i < PERF_COUNTERS && !perf_errno; i++) {
+        ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void perf_stop(void) {
+    for (size_t i = 0; i < PERF_COUNTERS; i++) {
+        perf_values[i] = -1;
+        if (perf_fds[i] == -1) continue;
+        if (!perf_errno &&
+            read(perf_fds[i], &perf_values[i], sizeof(perf_values[i])) != sizeof(perf_values[i]))
+            perf_values[i] = -1;
+        close(perf_fds[i]);
+        perf_fds[i] = -1;
+    }
+}
+
+// ---------- --stats report ----------
+void print_stats(double elapsed) {
+    fprintf(stderr, "elapsed: %.6f s\n", elapsed);
+    fprintf(stderr, "metadata: %ld lstat calls\n", stat_lstat_calls);
+    if (stat_long_entries)
+        fprintf(stderr, "long: %ld entries, %.0f entries/s\n", stat_long_entries,
+                elapsed > 0 ? stat_long_entries / elapsed : 0.0);
+    if (stat_uid_lookups || stat_gid_lookups)
+        fprintf(stderr, "ids: uid %ld/%ld hits (%.1f%%), gid %ld/%ld hits (%.1f%%), "
+                        "%ld NSS lookups\n",
+                stat_uid_hits, stat_uid_lookups,
+                stat_uid_lookups ? 100.0 * stat_uid_hits / stat_uid_lookups : 0.0,
+                stat_gid_hits, stat_gid_lookups,
+                stat_gid_lookups ? 100.0 * stat_gid_hits / stat_gid_lookups : 0.0,
+                stat_nss_calls);
+    if (stat_sort_keys)
+        fprintf(stderr, "sort: %ld keys, %ld resolved past the 8-byte prefix\n",
+                stat_sort_keys, stat_sort_ties);
+    if (perf_errno)
+        fprintf(stderr, "perf: counters unavailable (%s)\n", strerror(perf_errno));
+    else if (perf_values[0] >= 0)
+        fprintf(stderr, "perf: %lld cache misses, %lld cache references, %lld instructions\n",
+                perf_values[0], perf_values[1], perf_values[2]);
+    if (stat_arena_dirs)
+        fprintf(stderr, "arena: %ld directories, %.1f allocations/dir, "
+                        "%ld mallocs (%.3f/dir)\n",
+                stat_arena_dirs, (double)stat_arena_allocs / stat_arena_dirs,
+                stat_mallocs, (double)stat_mallocs / stat_arena_dirs);
+    if (stat_time_hits || stat_time_misses)
+        fprintf(stderr, "time: %ld formatted, %ld minute hits, %ld zone lookups\n",
+                stat_time_hits + stat_time_misses, stat_time_hits, stat_tz_calls);
+    if (from_file)
+        fprintf(stderr, "batch: %ld paths, %.0f paths/s\n", stat_batch_paths,
+                elapsed > 0 ? stat_batch_paths / elapsed : 0.0);
+    if (flag_gitignore)
+        fprintf(stderr, "gitignore: %ld files, %ld rules, %ld entries checked, "
+                        "%ld ignored, %.6f s matching\n",
+                stat_gi_files, stat_gi_rules, stat_gi_checked,
+                stat_gi_ignored, stat_gi_nsec / 1e9);
+    if (flag_watch)
+        fprintf(stderr, "watch: %ld events, %ld redraws\n",
+                stat_watch_events, stat_watch_redraws);
+    if (cache_path || daemon_mode)
+        fprintf(stderr, "cache: %ld directories reused, %ld scanned\n",
+                stat_cache_hits, stat_cache_misses);
+}
+
+// ---------- Option handling ----------
+// Long-only options get values outside the char range.
+enum { OPT_GITIGNORE = 256, OPT_STATS, OPT_CACHE, OPT_WATCH, OPT_TOTAL_SIZE, OPT_JOBS, OPT_FROM_FILE,
+       OPT_COLOR, OPT_ID_FILES, OPT_TIME_STYLE, OPT_FORMAT, OPT_ROW_GROUP,
+       OPT_QUOTING_STYLE };
+
+// Puts every option back to its default. The daemon runs many requests
+// in one process, so state from the previous request must not leak.
+static void reset_options(void) {
+    free(ignore_list);
+    ignore_list = NULL;
+    ignore_count = 0;
+    flag_gitignore = flag_stats = flag_watch = flag_total_size = 0;
+    opt_jobs = 0;
+    from_file = NULL;
+    color_mode = COLOR_AUTO;
+    stat_lstat_calls = 0;
+    stat_arena_dirs = stat_arena_allocs = stat_mallocs = 0;
+    stat_sort_keys = stat_sort_ties = 0;
+    flag_id_files = flag_numeric = 0;
+    time_style = TIME_LOCALE;
+    out_format = FMT_TEXT;
+    flag_unsorted = flag_zero = zero_paths = prev_operand_dir = 0;
+    quoting_style = QUOTE_LITERAL;
+    flag_hide_control = -1;
+    line_end = '\n';
+    opt_row_group = 0;
+    json_started = 0;
+    stat_time_hits = stat_time_misses = stat_tz_calls = 0;
+    stat_uid_lookups = stat_uid_hits = stat_gid_lookups = stat_gid_hits = 0;
+    stat_nss_calls = 0;
+    stat_batch_paths = 0;
+    stat_long_entries = 0;
+    reset_seen_inodes();
+    stat_gi_files = stat_gi_rules = stat_gi_checked = stat_gi_ignored = 0;
+    stat_gi_nsec = 0;
+    stat_cache_hits = stat_cache_misses = 0;
+    stat_watch_events = stat_watch_redraws = 0;
+    optind = 0;     // glibc: fully re-initialise getopt
+}
+
+// Parses the listing options in 'argv' and produces the listing.
+int run_ls(int argc, char *argv[]) {
+    int flag_l = 0, flag_C = 0, flag_x = 0, flag_R = 0;
+    int opt;
+    static struct option long_opts[] = {
+        {"ignore", required_argument, 0, 'I'},
+        {"gitignore", no_argument, 0, OPT_GITIGNORE},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"cache", required_argument, 0, OPT_CACHE},
+        {"watch", no_argument, 0, OPT_WATCH},
+        {"total-size", no_argument, 0, OPT_TOTAL_SIZE},
+        {"jobs", required_argument, 0, OPT_JOBS},
+        {"from-file", required_argument, 0, OPT_FROM_FILE},
+        {"color", optional_argument, 0, OPT_COLOR},
+        {"id-files", no_argument, 0, OPT_ID_FILES},
+        {"numeric-uid-gid", no_argument, 0, 'n'},
+        {"zero", no_argument, 0, '0'},
+        {"hide-control-chars", no_argument, 0, 'q'},
+        {"show-control-chars", no_argument, 0, 'N'},
+        {"literal", no_argument, 0, 'N'},
+        {"escape", no_argument, 0, 'b'},
+        {"quoting-style", required_argument, 0, OPT_QUOTING_STYLE},
+        {"time-style", required_argument, 0, OPT_TIME_STYLE},
+        {"format", required_argument, 0, OPT_FORMAT},
+        {"row-group", required_argument, 0, OPT_ROW_GROUP},
+        {0, 0, 0, 0}
+    };
+    reset_options();
+    out_init_stdout();
+    while ((opt = getopt_long(argc, argv, "lnCxRUI:0qbN", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'l': flag_l = 1; break;
+            case 'n': flag_numeric = flag_l = 1; break;
+            case 'C': flag_C = 1; break;
+            case 'x': flag_x = 1; break;
+            case 'R': flag_R = 1; break;
+            case 'U': flag_unsorted = 1; break;
+            case '0': flag_zero = 1; break;
+            case 'q': flag_hide_control = 1; break;
+            case 'N':
+                quoting_style = QUOTE_LITERAL;
+                flag_hide_control = 0;
+                break;
+            case 'b': quoting_style = QUOTE_ESCAPE; break;
+            case OPT_QUOTING_STYLE:
+                if (!strcmp(optarg, "literal"))
+                    quoting_style = QUOTE_LITERAL;
+                else if (!strcmp(optarg, "escape"))
+                    quoting_style = QUOTE_ESCAPE;
+                else if (!strcmp(optarg, "c"))
+                    quoting_style = QUOTE_C;
+                else {
+                    fprintf(stderr, "ls: invalid argument '%s' for '--quoting-style'\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'I': add_ignore_pattern(optarg); break;
+            case OPT_GITIGNORE: flag_gitignore = 1; break;
+            case OPT_STATS: flag_stats = 1; break;
+            case OPT_CACHE: cache_path = optarg; break;
+            case OPT_WATCH: flag_watch = 1; break;
+            case OPT_TOTAL_SIZE: flag_total_size = 1; break;
+            case OPT_JOBS:
+                opt_jobs = atoi(optarg);
+                if (opt_jobs < 1) opt_jobs = 1;
+                if (opt_jobs > MAX_JOBS) opt_jobs = MAX_JOBS;
+                break;
+            case OPT_FROM_FILE: from_file = optarg; break;
+            case OPT_ID_FILES: flag_id_files = 1; break;
+            case OPT_ROW_GROUP:
+                opt_row_group = atoi(optarg);
+                if (opt_row_group < 0) opt_row_group = 0;
+                break;
+            case OPT_FORMAT:
+                if (!strcmp(optarg, "json"))
+                    out_format = FMT_JSON;
+                else if (!strcmp(optarg, "ndjson"))
+                    out_format = FMT_NDJSON;
+                else if (!strcmp(optarg, "binary"))
+                    out_format = FMT_BINARY;
+                else if (!strcmp(optarg, "columnar"))
+                    out_format = FMT_COLUMNAR;
+                else if (!strcmp(optarg, "long") || !strcmp(optarg, "verbose"))
+                    flag_l = 1;
+                else if (!strcmp(optarg, "across") || !strcmp(optarg, "horizontal"))
+                    flag_x = 1;
+                else if (!strcmp(optarg, "vertical"))
+                    flag_C = 1;
+                else if (!strcmp(optarg, "single-column"))
+                    flag_l = flag_C = flag_x = 0;
+                else {
+                    fprintf(stderr, "ls: invalid argument '%s' for '--format'\n", optarg);
+                    return 2;
+                }
+                break;
+            case OPT_TIME_STYLE:
+                if (!strcmp(optarg, "locale") || !strcmp(optarg, "default"))
+                    time_style = TIME_LOCALE;
+                else if (!strcmp(optarg, "long-iso"))
+                    time_style = TIME_LONG_ISO;
+                else if (!strcmp(optarg, "full-iso"))
+                    time_style = TIME_FULL_ISO;
+                else if (!strcmp(optarg, "iso"))
+                    time_style = TIME_ISO;
+                else {
+                    fprintf(stderr, "ls: invalid argument '%s' for '--time-style'\n", optarg);
+                    return 2;
+                }
+                break;
+            case OPT_COLOR:
+                if (!optarg || !strcmp(optarg, "always") || !strcmp(optarg, "yes") ||
+                    !strcmp(optarg, "force"))
+                    color_mode = COLOR_ALWAYS;
+                else if (!strcmp(optarg, "never") || !strcmp(optarg, "no") ||
+                         !strcmp(optarg, "none"))
+                    color_mode = COLOR_NEVER;
+                else if (!strcmp(optarg, "auto") || !strcmp(optarg, "tty") ||
+                         !strcmp(optarg, "if-tty"))
+                    color_mode = COLOR_AUTO;
+                else {
+                    fprintf(stderr, "ls: invalid argument '%s' for '--color'\n", optarg);
+                    return 2;
+                }
+                break;
+            default: break;
+        }
+    }
+
+    if (from_file && (optind < argc || flag_watch)) {
+        fprintf(stderr, "ls: --from-file cannot be combined with path operands or --watch\n");
+        return 2;
+    }
+    if (flag_watch && (flag_R || argc - optind > 1)) {
+        // One directory is watched, with one inotify watch and no subtree.
+        fprintf(stderr, "ls: --watch takes one directory and cannot be combined with -R\n");
+        return 2;
+    }
+    if (out_format != FMT_TEXT && (flag_watch || flag_total_size)) {
+        fprintf(stderr, "ls: --format=%s cannot be combined with --watch or --total-size\n",
+                out_format == FMT_JSON ? "json" :
+                out_format == FMT_NDJSON ? "ndjson" :
+                out_format == FMT_BINARY ? "binary" : "columnar");
+        return 2;
+    }
+    if (flag_zero && (flag_total_size || flag_watch)) {
+        // Both print text headers that have no place in a NUL-separated list.
+        fprintf(stderr, "ls: --zero cannot be combined with --total-size or --watch\n");
+        return 2;
+    }
+    if ((out_format == FMT_BINARY || out_format == FMT_COLUMNAR) && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "ls: not writing binary output to a terminal\n");
+        return 2;
+    }
+    if (daemon_mode && (cache_path || flag_watch)) {
+        fprintf(stderr, "ls: --cache and --watch are not available through --server\n");
+        cache_path = NULL;
+        return 2;
+    }
+
+    time_now = time(NULL);
+    use_color = !flag_zero && (color_mode == COLOR_ALWAYS ||
+                (color_mode == COLOR_AUTO && isatty(STDOUT_FILENO)));
+    if (flag_hide_control < 0) flag_hide_control = isatty(STDOUT_FILENO);
+    quoting_active = !flag_zero && out_format == FMT_TEXT &&
+                     (quoting_style != QUOTE_LITERAL || flag_hide_control);
+    quote_special[0] = quote_special[1] = '\n';   // already a control byte
+    if (quoting_style != QUOTE_LITERAL) {
+        quote_special[0] = '\\';
+        quote_special[1] = quoting_style == QUOTE_ESCAPE ? ' ' : '"';
+    }
+    if (flag_zero) {
+        line_end = '\0';
+        zero_paths = flag_R;
+        flag_C = flag_x = 0;
+    }
+    if (flag_watch) flag_unsorted = 0;  // redraws look entries up by name
+
+    char *dot[] = { ".", NULL };
+    char **operands = optind < argc ? &argv[optind] : dot;
+    int count = optind < argc ? argc - optind : 1;
+    struct listing_flags flags = { flag_l, flag_C, flag_x, flag_R };
+
+    int status = 0;
+    double start = flag_stats ? now_seconds() : 0;
+    if (flag_stats) perf_start();
+    if (cache_path) cache_load(cache_path);
+    if (out_format == FMT_JSON) out_putc(out, '[');
+    if (out_format == FMT_BINARY) put_lsbin_header();
+    if (out_format == FMT_COLUMNAR) put_lscol_header();
+    if (flag_watch)
+        watch_ls(operands[0], flag_l, flag_C, flag_x);
+    else if (from_file)
+        status = list_from_file(&flags);
+    else
+        status = list_operands(operands, count, &flags, opt_jobs ? opt_jobs : MAX_JOBS);
+    if (out_format == FMT_JSON) out_puts(out, json_started ? "\n]\n" : "]\n");
+    if (cache_path) cache_save(cache_path);
+    out_flush(out);
+    if (flag_stats) {
+        perf_stop();
+        print_stats(now_seconds() - start);
+    }
+    if (output_error && status < 2) status = 2;
+    return status;
+}
+
+// ---------- Listing daemon (--daemon=SOCKET / --server=SOCKET) ----------
+// The client connects to the daemon's UNIX socket and passes its own
+// stdout and stderr descriptors (SCM_RIGHTS) along with its working
+// directory, the environment variables that shape output, and arguments.
+// The daemon adopts that environment (parsing LS_COLORS, TZ or the locale
+// again only when one changed since the last request), points fds 1 and 2
+// at the passed descriptors, runs the request through run_ls() and
+// replies with the exit status. Output is therefore produced exactly as a
+// normal run would produce it, tty detection and terminal width included,
+// while the name cache and the directory cache stay warm between requests.
+//
+// Request: one sendmsg carrying the two fds and a uint32_t payload length,
+// then the payload "cwd\0NAME=value\0...\0\0arg1\0arg2\0...": the
+// forwarded variables that are set, an empty string, then the arguments.
+// Reply: one int32_t status. Requests are served one at a time, so a
+// client that does not send its request within DAEMON_TIMEOUT seconds is
+// dropped rather than left to hold up the others.
+//
+// A request runs with the daemon's privileges in a directory the client
+// chooses, so the socket is created mode 0600 and a connection whose
+// peer (SO_PEERCRED) is not the daemon's own user is closed unserved.
+#define DAEMON_MAX_REQUEST (1 << 20)
+#define DAEMON_TIMEOUT 5
+
+static const char *const daemon_env_names[] = { "LS_COLORS", "TZ", "LC_ALL", "LC_CTYPE", "LANG" };
+#define DAEMON_ENV_COUNT (sizeof(daemon_env_names) / sizeof(daemon_env_names[0]))
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+// Sends on a socket; a peer that hung up is an error, not a SIGPIPE.
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t w = send(fd, p, len, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int socket_address(const char *sock_path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", sock_path);
+        return -1;
+    }
+    strcpy(addr->sun_path, sock_path);
+    return 0;
+}
+
+// Makes the daemon's environment match the request's 'env' (the
+// forwarded variables that the client has set) and reloads whatever
+// depends on a variable that changed.
+static void daemon_adopt_env(char **env, int count) {
+    int colors = 0, zone = 0, locale = 0;
+    for (size_t v = 0; v < DAEMON_ENV_COUNT; v++) {
+        const char *name = daemon_env_names[v], *value = NULL;
+        size_t name_len = strlen(name);
+        for (int i = 0; i < count; i++)
+            if (strncmp(env[i], name, name_len) == 0 && env[i][name_len] == '=')
+                value = env[i] + name_len + 1;
+        const char *cur = getenv(name);
+        if (cur == value || (cur && value && strcmp(cur, value) == 0)) continue;
+        if (value) setenv(name, value, 1);
+        else unsetenv(name);
+        if (v == 0) colors = 1;
+        else if (v == 1) zone = 1;
+        else locale = 1;
+    }
+    if (locale) reload_locale();
+    if (colors) reload_colors();
+    if (zone) reload_time_zone();
+}
+
+// Handles one connection. Errors only drop the connection.
+static void daemon_serve_one(int conn, int saved_out, int saved_err) {
+    uint32_t len;
+    int fds[2];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &len, sizeof(len) };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(len)) return;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return;
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+    char *payload = NULL;
+    char **args = NULL;
+    if (len == 0 || len > DAEMON_MAX_REQUEST) goto out;
+    payload = malloc(len + 1);
+    if (!payload || read_full(conn, payload, len) == -1) goto out;
+    payload[len] = '\0';
+
+    // payload: cwd, the environment up to an empty string, the arguments
+    int strings = 0;
+    for (uint32_t i = 0; i < len; i++)
+        if (payload[i] == '\0') strings++;
+    args = malloc(sizeof(*args) * (strings + 1));
+    if (!args) goto out;
+    char *p = payload;
+    const char *cwd = p;
+    p += strlen(p) + 1;
+    char **env = args + 1;
+    int nenv = 0;
+    while (p < payload + len && *p) {
+        env[nenv++] = p;
+        p += strlen(p) + 1;
+    }
+    if (p >= payload + len) goto out;   // no end of environment
+    p++;
+    args[0] = "ls";
+    daemon_adopt_env(env, nenv);
+    int n = 1;
+    while (p < payload + len) {
+        args[n++] = p;
+        p += strlen(p) + 1;
+    }
+    args[n] = NULL;
+
+    int32_t status = 2;
+    daemon_invalidate();
+    if (chdir(cwd) == 0) {
+        fflush(stderr);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        status = run_ls(n, args);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+    }
+    write_full(conn, &status, sizeof(status));
+
+out:
+    free(args);
+    free(payload);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int run_daemon(const char *sock_path) {
+    struct sockaddr_un addr;
+    if (socket_address(sock_path, &addr) == -1) return 2;
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1) {
+        perror("socket");
+        return 2;
+    }
+    unlink(sock_path);
+    mode_t old_mask = umask(0177);
+    int bound = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound == -1 || chmod(sock_path, 0600) == -1 || listen(lfd, 64) == -1) {
+        perror(sock_path);
+        close(lfd);
+        return 2;
+    }
+
+    daemon_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (daemon_inotify_fd == -1) {
+        perror("inotify_init1");
+        close(lfd);
+        return 2;
+    }
+    daemon_mode = 1;
+    cache_grow();
+    signal(SIGPIPE, SIG_IGN);   // a client going away must not kill us
+
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    for (;;) {
+        int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        struct ucred peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 ||
+            peer.uid != geteuid()) {
+            fprintf(stderr, "ls: refusing a client that is not uid %u\n", (unsigned)geteuid());
+            close(conn);
+            continue;
+        }
+        struct timeval timeout = { DAEMON_TIMEOUT, 0 };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        daemon_serve_one(conn, saved_out, saved_err);
+        close(conn);
+    }
+    close(lfd);
+    return 2;
+}
+
+// Forwards argv (minus the --server option) to the daemon and returns
+// its exit status.
+int run_client(const char *sock_path, int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    if (socket_address(sock_path, &addr) == -1) return 2;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(sock_path);
+        return 2;
+    }
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("getcwd");
+        return 2;
+    }
+    size_t len = strlen(cwd) + 2;
+    for (size_t v = 0; v < DAEMON_ENV_COUNT; v++) {
+        const char *value = getenv(daemon_env_names[v]);
+        if (value) len += strlen(daemon_env_names[v]) + strlen(value) + 2;
+    }
+    for (int i = 1; i < argc; i++) len += strlen(argv[i]) + 1;
+    char *payload = malloc(len);
+    if (!payload) {
+        perror("malloc");
+        return 2;
+    }
+    char *p = payload;
+    p = stpcpy(p, cwd) + 1;
+    for (size_t v = 0; v < DAEMON_ENV_COUNT; v++) {
+        const char *value = getenv(daemon_env_names[v]);
+        if (!value) continue;
+        p = stpcpy(p, daemon_env_names[v]);
+        *p++ = '=';
+        p = stpcpy(p, value) + 1;
+    }
+    *p++ = '\0';
+    for (int i = 1; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+
+    uint32_t len32 = (uint32_t)len;
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct iovec iov = { &len32, sizeof(len32) };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int32_t status = 2;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(len32) ||
+        write_full(fd, payload, len) == -1 ||
+        read_full(fd, &status, sizeof(status)) == -1) {
+        fprintf(stderr, "%s: daemon did not answer\n", sock_path);
+        status = 2;
+    }
+    free(payload);
+    close(fd);
+    return status;
+}
+
+// ---------- main ----------
+int main(int argc, char *argv[]) {
+    setlocale(LC_CTYPE, "");    // multibyte names for display widths
+
+    // --daemon and --server select how the program runs rather than what
+    // it lists, so they are picked out before normal option parsing.
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--daemon=", 9) == 0)
+            return run_daemon(argv[i] + 9);
+        if (strncmp(argv[i], "--server=", 9) == 0) {
+            const char *sock_path = argv[i] + 9;
+            memmove(&argv[i], &argv[i + 1], sizeof(*argv) * (argc - i));
+            return run_client(sock_path, argc - 1, argv);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int status = run_ls(argc, argv);
+    if (output_closed) {
+        // Die the way a program writing to a closed pipe normally does.
+        signal(SIGPIPE, SIG_DFL);
+        raise(SIGPIPE);
+    }
+    return status;
+}
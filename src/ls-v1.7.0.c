@@ -0,0 +1,349 @@
+/*
+ ============================================================================
+ Name        : ls-v1.7.0.c
+ Description : Feature 8 – Ignore Patterns (--ignore / -I)
+               Includes all previous features (1–7)
+ ============================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fnmatch.h>
+
+#define COL_PADDING 2
+#define DEFAULT_TERM_WIDTH 80
+#define MAX_FILES 4096
+
+// ---------- ANSI color codes ----------
+#define RESET_COLOR   "\033[0m"
+#define BLUE_COLOR    "\033[0;34m"
+#define GREEN_COLOR   "\033[0;32m"
+#define RED_COLOR     "\033[0;31m"
+#define MAGENTA_COLOR "\033[0;35m"
+#define REVERSE_VIDEO "\033[7m"
+
+// ---------- Get terminal width ----------
+int get_terminal_width() {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0)
+        return DEFAULT_TERM_WIDTH;
+    return (int)w.ws_col;
+}
+
+// ---------- Case-insensitive alphabetical sort ----------
+int cmp_names(const void *a, const void *b) {
+    const char *A = *(const char **)a;
+    const char *B = *(const char **)b;
+    return strcasecmp(A, B);
+}
+
+// ---------- Color logic ----------
+const char* get_color(const char *path, const char *name) {
+    static char full[1024];
+    struct stat st;
+
+    snprintf(full, sizeof(full), "%s/%s", path, name);
+    if (lstat(full, &st) == -1)
+        return RESET_COLOR;
+
+    if (S_ISDIR(st.st_mode))
+        return BLUE_COLOR;
+    else if (S_ISLNK(st.st_mode))
+        return MAGENTA_COLOR;
+    else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISSOCK(st.st_mode))
+        return REVERSE_VIDEO;
+    else if (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
+        return GREEN_COLOR;
+    else if (strstr(name, ".tar") || strstr(name, ".gz") ||
+             strstr(name, ".zip") || strstr(name, ".tgz"))
+        return RED_COLOR;
+    else
+        return RESET_COLOR;
+}
+
+// ---------- Ignore patterns (--ignore / -I) ----------
+// Each pattern is classified once when it is added, so the common shapes
+// (".git", "node_modules", "build*", "*.tmp") are matched with a length
+// check and memcmp instead of a full fnmatch() per entry.
+enum ignore_kind { IGN_LITERAL, IGN_PREFIX, IGN_SUFFIX, IGN_CONTAINS, IGN_ALL, IGN_GLOB };
+
+struct ignore_pattern {
+    enum ignore_kind kind;
+    const char *text;   // literal part (or full pattern for IGN_GLOB)
+    size_t len;         // length of the literal part
+};
+
+static struct ignore_pattern *ignore_list = NULL;
+static int ignore_count = 0;
+
+static int has_glob_chars(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+            return 1;
+    return 0;
+}
+
+void add_ignore_pattern(const char *pattern) {
+    struct ignore_pattern *grown =
+        realloc(ignore_list, sizeof(*ignore_list) * (ignore_count + 1));
+    if (!grown) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    ignore_list = grown;
+
+    struct ignore_pattern *p = &ignore_list[ignore_count++];
+    size_t len = strlen(pattern);
+    int lead  = (len > 0 && pattern[0] == '*');
+    int trail = (len > 1 && pattern[len - 1] == '*');
+    const char *body = pattern + lead;
+    size_t body_len = len - lead - trail;
+
+    if (len == 1 && lead) {
+        p->kind = IGN_ALL; p->text = pattern; p->len = 0;
+    } else if (has_glob_chars(body, body_len)) {
+        p->kind = IGN_GLOB; p->text = pattern; p->len = len;
+    } else if (lead && trail) {
+        p->kind = IGN_CONTAINS; p->text = body; p->len = body_len;
+    } else if (lead) {
+        p->kind = IGN_SUFFIX; p->text = body; p->len = body_len;
+    } else if (trail) {
+        p->kind = IGN_PREFIX; p->text = body; p->len = body_len;
+    } else {
+        p->kind = IGN_LITERAL; p->text = pattern; p->len = len;
+    }
+}
+
+// Returns 1 if 'name' (of length 'len') matches any --ignore pattern.
+int is_ignored(const char *name, size_t len) {
+    for (int i = 0; i < ignore_count; i++) {
+        const struct ignore_pattern *p = &ignore_list[i];
+        switch (p->kind) {
+            case IGN_LITERAL:
+                if (len == p->len && memcmp(name, p->text, len) == 0) return 1;
+                break;
+            case IGN_PREFIX:
+                if (len >= p->len && memcmp(name, p->text, p->len) == 0) return 1;
+                break;
+            case IGN_SUFFIX:
+                if (len >= p->len &&
+                    memcmp(name + len - p->len, p->text, p->len) == 0) return 1;
+                break;
+            case IGN_CONTAINS:
+                if (len >= p->len && memmem(name, len, p->text, p->len)) return 1;
+                break;
+            case IGN_ALL:
+                return 1;
+            case IGN_GLOB:
+                if (fnmatch(p->text, name, 0) == 0) return 1;
+                break;
+        }
+    }
+    return 0;
+}
+
+// ---------- Read filenames ----------
+int read_filenames(const char *path, char ***out) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        *out = NULL;
+        return 0;
+    }
+
+    char **names = malloc(sizeof(char *) * MAX_FILES);
+    if (!names) {
+        perror("malloc");
+        closedir(dir);
+        *out = NULL;
+        return 0;
+    }
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < MAX_FILES) {
+        if (entry->d_name[0] == '.') continue;
+        // Pruned here, straight off the readdir buffer: an ignored entry is
+        // never strdup'd or stat'ed, and an ignored directory never opened.
+        if (ignore_count && is_ignored(entry->d_name, strlen(entry->d_name)))
+            continue;
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char *), cmp_names);
+    *out = names;
+    return count;
+}
+
+void free_names(char **names, int n) {
+    for (int i = 0; i < n; i++) free(names[i]);
+    free(names);
+}
+
+// ---------- Long Listing (-l) ----------
+void print_long_listing(const char *path, char **names, int n) {
+    struct stat st;
+    char full[1024];
+
+    for (int i = 0; i < n; i++) {
+        snprintf(full, sizeof(full), "%s/%s", path, names[i]);
+        if (lstat(full, &st) == -1) {
+            perror(names[i]);
+            continue;
+        }
+
+        printf((S_ISDIR(st.st_mode)) ? "d" : "-");
+        printf((st.st_mode & S_IRUSR) ? "r" : "-");
+        printf((st.st_mode & S_IWUSR) ? "w" : "-");
+        printf((st.st_mode & S_IXUSR) ? "x" : "-");
+        printf((st.st_mode & S_IRGRP) ? "r" : "-");
+        printf((st.st_mode & S_IWGRP) ? "w" : "-");
+        printf((st.st_mode & S_IXGRP) ? "x" : "-");
+        printf((st.st_mode & S_IROTH) ? "r" : "-");
+        printf((st.st_mode & S_IWOTH) ? "w" : "-");
+        printf((st.st_mode & S_IXOTH) ? "x" : "-");
+
+        struct passwd *pw = getpwuid(st.st_uid);
+        struct group  *gr = getgrgid(st.st_gid);
+        char timebuf[64];
+        strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", localtime(&st.st_mtime));
+
+        const char *color = get_color(path, names[i]);
+        printf(" %2ld %-8s %-8s %8ld %s %s%s%s\n",
+               (long)st.st_nlink,
+               pw ? pw->pw_name : "?",
+               gr ? gr->gr_name : "?",
+               (long)st.st_size,
+               timebuf,
+               color, names[i], RESET_COLOR);
+    }
+}
+
+// ---------- Column Display (-C) ----------
+void print_down_then_across(const char *path, char **names, int n) {
+    if (n == 0) return;
+    int term_width = get_terminal_width();
+    size_t maxlen = 0;
+    for (int i = 0; i < n; i++)
+        if (strlen(names[i]) > maxlen) maxlen = strlen(names[i]);
+    int col_width = (int)maxlen + COL_PADDING;
+    if (col_width <= 0) col_width = 1;
+    int cols = term_width / col_width;
+    if (cols < 1) cols = 1;
+    if (cols > n) cols = n;
+    int rows = (n + cols - 1) / cols;
+    if (rows == 1 && n > 3) { rows = (n + 1) / 2; cols = (n + rows - 1) / rows; }
+
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            int idx = r + c * rows;
+            if (idx < n) {
+                const char *color = get_color(path, names[idx]);
+                printf("%s%-*s%s", color, (int)maxlen, names[idx], RESET_COLOR);
+            }
+            if (c < cols - 1)
+                for (int s = 0; s < COL_PADDING; s++) putchar(' ');
+        }
+        putchar('\n');
+    }
+}
+
+// ---------- Horizontal Display (-x) ----------
+void print_horizontal_across(const char *path, char **names, int n) {
+    if (n == 0) return;
+    int term_width = get_terminal_width();
+    size_t maxlen = 0;
+    for (int i = 0; i < n; i++)
+        if (strlen(names[i]) > maxlen) maxlen = strlen(names[i]);
+    int col_width = (int)maxlen + COL_PADDING;
+    int current_width = 0;
+
+    for (int i = 0; i < n; i++) {
+        int needed = col_width;
+        if (current_width + needed > term_width) {
+            putchar('\n');
+            current_width = 0;
+        }
+        const char *color = get_color(path, names[i]);
+        printf("%s%-*s%s", color, (int)maxlen, names[i], RESET_COLOR);
+        current_width += needed;
+    }
+    putchar('\n');
+}
+
+// ---------- Recursive Listing ----------
+void do_ls(const char *path, int flag_l, int flag_C, int flag_x, int flag_R) {
+    char **names = NULL;
+    int n = read_filenames(path, &names);
+    if (n <= 0) return;
+
+    printf("\n%s:\n", path);
+
+    if (flag_l)
+        print_long_listing(path, names, n);
+    else if (flag_x)
+        print_horizontal_across(path, names, n);
+    else if (flag_C)
+        print_down_then_across(path, names, n);
+    else
+        for (int i = 0; i < n; i++) {
+            const char *color = get_color(path, names[i]);
+            printf("%s%s%s\n", color, names[i], RESET_COLOR);
+        }
+
+    // Recursive part
+    if (flag_R) {
+        struct stat st;
+        char full[1024];
+        for (int i = 0; i < n; i++) {
+            snprintf(full, sizeof(full), "%s/%s", path, names[i]);
+            if (lstat(full, &st) == -1) continue;
+            if (S_ISDIR(st.st_mode) &&
+                strcmp(names[i], ".") != 0 &&
+                strcmp(names[i], "..") != 0) {
+                do_ls(full, flag_l, flag_C, flag_x, flag_R);
+            }
+        }
+    }
+
+    free_names(names, n);
+}
+
+// ---------- main ----------
+int main(int argc, char *argv[]) {
+    int flag_l = 0, flag_C = 0, flag_x = 0, flag_R = 0;
+    int opt;
+    static struct option long_opts[] = {
+        {"ignore", required_argument, 0, 'I'},
+        {0, 0, 0, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "lCxRI:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'l': flag_l = 1; break;
+            case 'C': flag_C = 1; break;
+            case 'x': flag_x = 1; break;
+            case 'R': flag_R = 1; break;
+            case 'I': add_ignore_pattern(optarg); break;
+            default: break;
+        }
+    }
+
+    const char *path = ".";
+    if (optind < argc) path = argv[optind];
+
+    do_ls(path, flag_l, flag_C, flag_x, flag_R);
+    return 0;
+}
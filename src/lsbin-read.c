@@ -0,0 +1,265 @@
+/*
+ ============================================================================
+ Name        : lsbin-read.c
+ Description : Decoder for `ls --format=binary` and `--format=columnar`
+               streams (see lsbin.h); the kind is taken from the magic
+               Usage: lsbin-read [-s] [FILE]   (stdin if FILE is omitted)
+               Prints one line per entry:
+                 mode nlink uid gid size mtime.nsec path
+               (nlink is not part of a columnar export and shows as 1)
+               -s prints only a summary (entries, directories or row
+               groups, bytes, decode rate), which is what `make bench` uses.
+ ============================================================================
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lsbin.h"
+
+// Lengths read from the stream are checked against these before anything
+// is allocated, so a corrupt or crafted file is rejected, not trusted.
+#define RECORD_SIZE_MAX (64u * 1024)
+#define NAME_LEN_MAX    (1u << 20)
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_full(FILE *fp, void *buf, size_t len) {
+    return fread(buf, 1, len, fp) == len ? 0 : -1;
+}
+
+static int summary = 0;
+static long long entries = 0, dirs = 0, groups = 0, bytes = 0;
+static long long file_size = -1;    // -1 when the input is not a regular file
+
+// Whether 'len' more bytes can still follow in the input.
+static int fits_in_input(uint64_t len) {
+    return file_size < 0 || len <= (uint64_t)(file_size - bytes);
+}
+
+static void print_entry(uint32_t mode, uint32_t nlink, uint32_t uid, uint32_t gid,
+                        uint64_t size, int64_t sec, uint32_t nsec,
+                        const char *dir, const char *name, size_t name_len) {
+    entries++;
+    if (summary) return;
+    if (dir && !memchr(name, '/', name_len))
+        printf("%06o %u %u %u %llu %lld.%09u %s/%.*s\n", mode, nlink, uid, gid,
+               (unsigned long long)size, (long long)sec, nsec, dir, (int)name_len, name);
+    else
+        printf("%06o %u %u %u %llu %lld.%09u %.*s\n", mode, nlink, uid, gid,
+               (unsigned long long)size, (long long)sec, nsec, (int)name_len, name);
+}
+
+// Element size of each column; NAMES is a byte blob checked through its offsets.
+static const uint64_t column_elem[LSCOL_COLUMNS] = {
+    [LSCOL_NAME_OFFSETS] = 4, [LSCOL_NAMES] = 1, [LSCOL_MODES] = 4,
+    [LSCOL_SIZES] = 8, [LSCOL_MTIMES] = 8, [LSCOL_UIDS] = 4, [LSCOL_GIDS] = 4,
+};
+
+// Row groups: each column is read as one array; see lsbin.h.
+static int decode_columns(FILE *fp, const char *file, const struct lscol_header *h) {
+    if (h->group_header_size < sizeof(struct lscol_group)) {
+        fprintf(stderr, "%s: bad group header size\n", file);
+        return 2;
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    uint64_t group_size;
+    while (read_full(fp, &group_size, sizeof(group_size)) == 0) {
+        if (group_size < h->group_header_size || group_size > ((uint64_t)1 << 40) ||
+            !fits_in_input(group_size - sizeof(group_size))) {
+            fprintf(stderr, "%s: bad group size\n", file);
+            return 2;
+        }
+        if (group_size > cap) {
+            cap = (size_t)group_size;
+            buf = realloc(buf, cap);
+            if (!buf) {
+                perror("realloc");
+                return 2;
+            }
+        }
+        memcpy(buf, &group_size, sizeof(group_size));
+        if (read_full(fp, buf + sizeof(group_size), group_size - sizeof(group_size)) == -1) {
+            fprintf(stderr, "%s: truncated group\n", file);
+            return 2;
+        }
+        bytes += (long long)group_size;
+
+        struct lscol_group g;
+        memcpy(&g, buf, sizeof(g));
+        for (int c = 0; c < LSCOL_COLUMNS; c++)
+            if (g.column_size[c] > group_size ||
+                g.column_offset[c] > group_size - g.column_size[c]) {
+                fprintf(stderr, "%s: column outside its group\n", file);
+                return 2;
+            }
+        // Every column must hold 'rows' elements (rows + 1 offsets), and the
+        // path must lie inside the group, before anything is read from them.
+        for (int c = 0; c < LSCOL_COLUMNS; c++)
+            if (c != LSCOL_NAMES &&
+                g.column_size[c] < column_elem[c] * ((uint64_t)g.rows + (c == LSCOL_NAME_OFFSETS))) {
+                fprintf(stderr, "%s: column too short for %u rows\n", file, g.rows);
+                return 2;
+            }
+        if (g.path_len > group_size - h->group_header_size) {
+            fprintf(stderr, "%s: bad path length %u\n", file, g.path_len);
+            return 2;
+        }
+        char dir[4096];
+        size_t path_len = g.path_len < sizeof(dir) ? g.path_len : sizeof(dir) - 1;
+        memcpy(dir, buf + h->group_header_size, path_len);
+        dir[path_len] = '\0';
+        groups++;
+
+        const char *names = buf + g.column_offset[LSCOL_NAMES];
+        for (uint32_t i = 0; i < g.rows; i++) {
+            uint32_t off[2], mode, uid, gid;
+            uint64_t size;
+            int64_t mtime;
+            memcpy(off, buf + g.column_offset[LSCOL_NAME_OFFSETS] + 4 * i, sizeof(off));
+            memcpy(&mode, buf + g.column_offset[LSCOL_MODES] + 4 * i, 4);
+            memcpy(&size, buf + g.column_offset[LSCOL_SIZES] + 8 * i, 8);
+            memcpy(&mtime, buf + g.column_offset[LSCOL_MTIMES] + 8 * i, 8);
+            memcpy(&uid, buf + g.column_offset[LSCOL_UIDS] + 4 * i, 4);
+            memcpy(&gid, buf + g.column_offset[LSCOL_GIDS] + 4 * i, 4);
+            if (off[0] > off[1] || off[1] > g.column_size[LSCOL_NAMES]) {
+                fprintf(stderr, "%s: bad name offsets\n", file);
+                return 2;
+            }
+            int64_t sec = mtime / 1000000000, nsec = mtime % 1000000000;
+            if (nsec < 0) {
+                nsec += 1000000000;
+                sec--;
+            }
+            print_entry(mode, 1, uid, gid, size, sec, (uint32_t)nsec,
+                        dir, names + off[0], off[1] - off[0]);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') summary = 1;
+        else {
+            fprintf(stderr, "usage: %s [-s] [FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+    const char *file = optind < argc ? argv[optind] : "-";
+    FILE *fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    if (!fp) {
+        perror(file);
+        return 2;
+    }
+
+    struct lsbin_header h;
+    int columnar = 0;
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)) file_size = st.st_size;
+
+    if (read_full(fp, &h, sizeof(h)) == 0 && memcmp(h.magic, LSCOL_MAGIC, 4) == 0) {
+        columnar = 1;
+    } else if (memcmp(h.magic, LSBIN_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not an lsbin stream\n", file);
+        return 2;
+    }
+    // Both headers share magic, version, header_size and byte_order.
+    struct lscol_header ch;
+    memcpy(&ch, &h, sizeof(ch));
+    if ((columnar ? ch.byte_order : h.byte_order) != LSBIN_BYTE_ORDER) {
+        fprintf(stderr, "%s: written with a different byte order\n", file);
+        return 2;
+    }
+    if (columnar ? ch.version != LSCOL_VERSION :
+                   (h.version != LSBIN_VERSION || h.record_size < sizeof(struct lsbin_record) ||
+                    h.record_size > RECORD_SIZE_MAX) ||
+        h.header_size < sizeof(h)) {
+        fprintf(stderr, "%s: unsupported version %u\n", file, h.version);
+        return 2;
+    }
+    // Skip header fields added by a later minor revision.
+    for (size_t skip = h.header_size - sizeof(h); skip; skip--)
+        if (fgetc(fp) == EOF) return 2;
+    bytes = h.header_size;
+    double start = now_seconds();
+    if (columnar) {
+        int status = decode_columns(fp, file, &ch);
+        if (status) return status;
+        goto done;
+    }
+
+    char *rec = malloc(h.record_size);
+    char *name = NULL, *dir = NULL;
+    size_t name_cap = 0, dir_cap = 0;
+    if (!rec) {
+        perror("malloc");
+        return 2;
+    }
+
+    while (read_full(fp, rec, h.record_size) == 0) {
+        struct lsbin_record r;
+        memcpy(&r, rec, sizeof(r));
+        bytes += h.record_size;
+        // In size_t: record_size + name_len must not wrap around.
+        size_t padded = (((size_t)h.record_size + r.name_len + 7) & ~(size_t)7) - h.record_size;
+        if (r.name_len > NAME_LEN_MAX || !fits_in_input(padded)) {
+            fprintf(stderr, "%s: bad name length %u\n", file, r.name_len);
+            return 2;
+        }
+        if (padded + 1 > name_cap) {
+            name_cap = padded + 1;
+            name = realloc(name, name_cap);
+            if (!name) {
+                perror("realloc");
+                return 2;
+            }
+        }
+        if (read_full(fp, name, padded) == -1) {
+            fprintf(stderr, "%s: truncated record\n", file);
+            return 2;
+        }
+        name[r.name_len] = '\0';     // name_len <= padded < name_cap
+        bytes += padded;
+
+        if (r.kind == LSBIN_DIR) {
+            if (r.name_len + 1 > dir_cap) {
+                dir_cap = r.name_len + 1;
+                dir = realloc(dir, dir_cap);
+                if (!dir) {
+                    perror("realloc");
+                    return 2;
+                }
+            }
+            memcpy(dir, name, r.name_len + 1);
+            dirs++;
+            continue;
+        }
+        if (r.kind != LSBIN_ENTRY) continue;    // unknown kinds are skipped
+        print_entry(r.mode, r.nlink, r.uid, r.gid, r.size, r.mtime_sec, r.mtime_nsec,
+                    dir, name, r.name_len);
+    }
+    free(rec);
+    free(name);
+    free(dir);
+
+done:
+    if (summary) {
+        double elapsed = now_seconds() - start;
+        printf("entries: %lld, %s: %lld, bytes: %lld, %.0f entries/s\n",
+               entries, columnar ? "row groups" : "directories", columnar ? groups : dirs,
+               bytes, elapsed > 0 ? entries / elapsed : 0.0);
+    }
+    if (fp != stdin) fclose(fp);
+    return 0;
+}
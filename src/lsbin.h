@@ -0,0 +1,103 @@
+/*
+ ============================================================================
+ Name        : lsbin.h
+ Description : Layouts of `ls --format=binary` (row records, version 1)
+               and `ls --format=columnar` (column groups, version 1),
+               shared by the writer and by lsbin-read
+ ============================================================================
+
+ A stream is one lsbin_header followed by records. Every record is a
+ fixed-size lsbin_record, then name_len bytes of name (no NUL), then zero
+ bytes up to the next multiple of 8, so every record header is 8-byte
+ aligned when the stream is mapped.
+
+   LSBIN_DIR    starts a directory; the name is its path as given and the
+                metadata fields are zero.
+   LSBIN_ENTRY  one entry of the preceding directory; the name is the
+                entry's name. Its path is "<dir>/<name>", unless the name
+                itself contains a '/' (a non-directory operand).
+
+ Fields are in the writer's byte order; byte_order reads as
+ LSBIN_BYTE_ORDER on a reader with the same order. Times are seconds
+ and nanoseconds since the epoch. Readers must reject a different major
+ version and use header_size / record_size to skip fields added later.
+*/
+#ifndef LSBIN_H
+#define LSBIN_H
+
+#include <stdint.h>
+
+#define LSBIN_MAGIC      "LSBN"
+#define LSBIN_VERSION    1
+#define LSBIN_BYTE_ORDER 0x01020304u
+
+enum lsbin_kind { LSBIN_DIR = 1, LSBIN_ENTRY = 2 };
+
+struct lsbin_header {
+    char magic[4];              // LSBIN_MAGIC
+    uint16_t version;           // LSBIN_VERSION
+    uint16_t header_size;       // sizeof(struct lsbin_header)
+    uint32_t record_size;       // sizeof(struct lsbin_record)
+    uint32_t byte_order;        // LSBIN_BYTE_ORDER
+};
+
+struct lsbin_record {
+    uint32_t kind;              // enum lsbin_kind
+    uint32_t name_len;
+    uint32_t mode;              // st_mode, type bits included
+    uint32_t nlink;
+    uint32_t uid, gid;
+    uint32_t dev_major, dev_minor;
+    uint32_t rdev_major, rdev_minor;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;            // 512-byte units
+    int64_t atime_sec, mtime_sec, ctime_sec;
+    uint32_t atime_nsec, mtime_nsec, ctime_nsec;
+    uint32_t blksize;
+};
+
+#define LSBIN_ALIGN(n) (((n) + 7u) & ~(uint32_t)7u)
+
+/*
+ Columnar export: one lscol_header, then row groups. A group holds up to
+ --row-group entries of one directory (the whole directory by default).
+ It starts with an lscol_group, followed by the directory path padded to
+ 8 bytes, then each column as one contiguous array, each starting on an
+ 8-byte boundary. column_offset[] is measured from the start of the
+ group, and group_size leads to the next group, so a reader can mmap the
+ file and visit a single column without touching the others.
+
+   NAME_OFFSETS  uint32[rows + 1]  start of each name in NAMES; the last
+                                   element is the blob length
+   NAMES         char[]            names, concatenated, no NUL
+   MODES         uint32[rows]      st_mode
+   SIZES         uint64[rows]      st_size
+   MTIMES        int64[rows]       mtime in nanoseconds since the epoch
+   UIDS, GIDS    uint32[rows]
+*/
+#define LSCOL_MAGIC   "LSCO"
+#define LSCOL_VERSION 1
+
+enum lscol_column {
+    LSCOL_NAME_OFFSETS, LSCOL_NAMES, LSCOL_MODES, LSCOL_SIZES,
+    LSCOL_MTIMES, LSCOL_UIDS, LSCOL_GIDS, LSCOL_COLUMNS
+};
+
+struct lscol_header {
+    char magic[4];              // LSCOL_MAGIC
+    uint16_t version;           // LSCOL_VERSION
+    uint16_t header_size;       // sizeof(struct lscol_header)
+    uint32_t group_header_size; // sizeof(struct lscol_group)
+    uint32_t byte_order;        // LSBIN_BYTE_ORDER
+};
+
+struct lscol_group {
+    uint64_t group_size;        // bytes from this group to the next
+    uint32_t rows;
+    uint32_t path_len;
+    uint64_t column_offset[LSCOL_COLUMNS];
+    uint64_t column_size[LSCOL_COLUMNS];
+};
+
+#endif